@@ -0,0 +1,191 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Benchmark host. Runs bench.lua against the synthetic Cubism Core with an */
+/* allocator that counts every Lua allocation. */
+
+/* std */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Lua */
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+/* Live2D (stub) */
+#include "Live2DCubismCore.h"
+
+#ifndef LUALIVE2D_BENCH_SCRIPT
+#define LUALIVE2D_BENCH_SCRIPT "bench.lua"
+#endif
+
+typedef struct AllocCounter
+{
+	size_t allocations, bytes;
+} AllocCounter;
+
+int luaopen_lualive2d_core(lua_State *L);
+
+static AllocCounter allocCounter;
+
+static void *l2db_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	AllocCounter *counter = (AllocCounter *) ud;
+
+	if (nsize == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+	/* Only new blocks and growth counts as allocation */
+	if (ptr == NULL)
+	{
+		counter->allocations++;
+		counter->bytes += nsize;
+	}
+	else if (nsize > osize)
+	{
+		counter->allocations++;
+		counter->bytes += nsize - osize;
+	}
+
+	return realloc(ptr, nsize);
+}
+
+/* bench.clock(): monotonic time in seconds */
+static int l2db_clock(lua_State *L)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+	lua_pushnumber(L, (lua_Number) counter.QuadPart / (lua_Number) frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushnumber(L, (lua_Number) ts.tv_sec + (lua_Number) ts.tv_nsec / 1e9);
+#endif
+	return 1;
+}
+
+/* bench.allocations(): amount of allocations and bytes allocated so far */
+static int l2db_allocations(lua_State *L)
+{
+	lua_pushnumber(L, (lua_Number) allocCounter.allocations);
+	lua_pushnumber(L, (lua_Number) allocCounter.bytes);
+	return 2;
+}
+
+/* bench.stubmoc(parameters, parts, drawables, vertices, maskedDrawables) */
+static int l2db_stubmoc(lua_State *L)
+{
+	csmStubMocInfo info;
+
+	memcpy(info.magic, "STUB", 4);
+	info.parameterCount = (unsigned int) luaL_checkint(L, 1);
+	info.partCount = (unsigned int) luaL_checkint(L, 2);
+	info.drawableCount = (unsigned int) luaL_checkint(L, 3);
+	info.vertexCount = (unsigned int) luaL_checkint(L, 4);
+	info.maskedDrawableCount = (unsigned int) luaL_optint(L, 5, 0);
+
+	lua_pushlstring(L, (const char *) &info, sizeof(csmStubMocInfo));
+	return 1;
+}
+
+static const luaL_Reg l2db_export[] = {
+	{"clock", &l2db_clock},
+	{"allocations", &l2db_allocations},
+	{"stubmoc", &l2db_stubmoc},
+	{NULL, NULL}
+};
+
+int main(int argc, char *argv[])
+{
+	const char *script = LUALIVE2D_BENCH_SCRIPT;
+	lua_State *L;
+	int argStart = 1, result;
+
+	/* First argument can be path to the script */
+	if (argc > 1 && strlen(argv[1]) > 4 && strcmp(argv[1] + strlen(argv[1]) - 4, ".lua") == 0)
+	{
+		script = argv[1];
+		argStart = 2;
+	}
+
+	L = lua_newstate(l2db_alloc, &allocCounter);
+	if (L == NULL)
+	{
+		fputs("cannot create Lua state\n", stderr);
+		return 1;
+	}
+
+	luaL_openlibs(L);
+
+	/* require("lualive2d.core") */
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	lua_pushcfunction(L, luaopen_lualive2d_core);
+	lua_setfield(L, -2, "lualive2d.core");
+	lua_pop(L, 2);
+
+	/* bench library */
+	luaL_register(L, "bench", l2db_export);
+	lua_pop(L, 1);
+
+	/* Remaining arguments are passed to the script */
+	lua_createtable(L, argc - argStart, 0);
+	for (int i = argStart; i < argc; i++)
+	{
+		lua_pushstring(L, argv[i]);
+		lua_rawseti(L, -2, i - argStart + 1);
+	}
+	lua_setglobal(L, "arg");
+
+	if (luaL_loadfile(L, script) || lua_pcall(L, 0, 1, 0))
+	{
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		lua_close(L);
+		return 1;
+	}
+
+	/* Script returns false on regression */
+	result = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+	lua_close(L);
+
+	return result;
+}
@@ -0,0 +1,303 @@
+-- lua-live2d benchmark, run by lualive2d_bench against the synthetic Cubism Core.
+-- Usage: lualive2d_bench [bench.lua] [options]
+--   --filter <pattern>  Only run benchmarks which name matches Lua pattern
+--   --time <seconds>    Minimum measurement time per benchmark (default 0.25)
+--   --save <file>       Write results as baseline
+--   --baseline <file>   Compare against baseline, returns false on regression.
+--                       Results are saved to it instead if it doesn't exist.
+--   --tolerance <n>     Allowed slowdown ratio against baseline (default 0.25)
+
+local core = require("lualive2d.core")
+
+local options = {time = 0.25, tolerance = 0.25}
+do
+	local i = 1
+	while i <= #arg do
+		local name = arg[i]:match("^%-%-(.+)")
+		if not(name) or options[name] == nil and name ~= "filter" and name ~= "save" and name ~= "baseline" then
+			error("unknown option "..arg[i])
+		end
+
+		options[name] = assert(arg[i + 1], "missing value for "..arg[i])
+		i = i + 2
+	end
+
+	options.time = assert(tonumber(options.time), "invalid time")
+	options.tolerance = assert(tonumber(options.tolerance), "invalid tolerance")
+end
+
+-- Synthetic model sizes: parameters, parts, drawables, vertices per drawable, masked drawables
+local models = {
+	{name = "small", 32, 16, 64, 64, 8},
+	{name = "large", 256, 64, 512, 256, 64},
+}
+
+local results = {}
+
+-- Run fn(state) until it takes at least options.time seconds
+local function measure(name, setup, fn)
+	if options.filter and not(name:find(options.filter)) then return end
+
+	local state = setup()
+	local iterations = 1
+	local elapsed, allocations, bytes
+
+	-- Warm up, also creates persistent tables
+	fn(state)
+
+	while true do
+		collectgarbage()
+		local a0, b0 = bench.allocations()
+		local t0 = bench.clock()
+		for _ = 1, iterations do
+			fn(state)
+		end
+		elapsed = bench.clock() - t0
+		local a1, b1 = bench.allocations()
+		allocations, bytes = a1 - a0, b1 - b0
+
+		if elapsed >= options.time then break end
+		-- Aim slightly above the target time
+		iterations = math.max(iterations * 2, math.ceil(iterations * options.time * 1.2 / math.max(elapsed, 1e-6)))
+	end
+
+	local result = {
+		name = name,
+		nsPerOp = elapsed * 1e9 / iterations,
+		opsPerSec = iterations / elapsed,
+		allocsPerOp = allocations / iterations,
+		bytesPerOp = bytes / iterations,
+	}
+	results[#results + 1] = result
+	print(string.format("%-48s %12.0f ops/s %12.1f ns/op %10.2f allocs/op %12.1f B/op",
+		name, result.opsPerSec, result.nsPerOp, result.allocsPerOp, result.bytesPerOp))
+end
+
+local function newModel(info)
+	local model = core.loadModelFromString(bench.stubmoc(unpack(info)))
+	model:update()
+	return model
+end
+
+for _, info in ipairs(models) do
+	local moc = bench.stubmoc(unpack(info))
+	local prefix = info.name.."/"
+	local function setupModel()
+		return {model = newModel(info)}
+	end
+
+	measure(prefix.."loadModelFromString", function() return {} end, function()
+		core.loadModelFromString(moc)
+	end)
+
+	-- Every parameter changes so all drawables are deformed
+	measure(prefix.."update", setupModel, function(s)
+		s.value = s.value == 0.5 and -0.5 or 0.5
+		local values = s.values or s.model:getParameterValues()
+		s.values = values
+		for i = 1, #values do values[i] = s.value end
+		s.model:setParameterValues(values)
+		s.model:update()
+	end)
+
+	measure(prefix.."readCanvasInfo", setupModel, function(s)
+		s.model:readCanvasInfo()
+	end)
+	measure(prefix.."getStaticMeshData", setupModel, function(s)
+		s.model:getStaticMeshData()
+	end)
+
+	for _, mode in ipairs({"indexed", "named"}) do
+		local named = mode == "named"
+		local suffix = "/"..mode
+
+		measure(prefix.."getParameterDefault"..suffix, setupModel, function(s)
+			s.model:getParameterDefault(named)
+		end)
+		measure(prefix.."getParameterValues"..suffix, setupModel, function(s)
+			s.model:getParameterValues(named)
+		end)
+		measure(prefix.."getParameterValues"..suffix.."/reuse", setupModel, function(s)
+			s.table = s.model:getParameterValues(s.table or {}, named)
+		end)
+		measure(prefix.."setParameterValues"..suffix, function()
+			local s = setupModel()
+			s.values = s.model:getParameterValues(named)
+			return s
+		end, function(s)
+			s.model:setParameterValues(s.values, named)
+		end)
+		measure(prefix.."getPartsData"..suffix, setupModel, function(s)
+			s.model:getPartsData(named)
+		end)
+		measure(prefix.."getPartsOpacity"..suffix, setupModel, function(s)
+			s.model:getPartsOpacity(named)
+		end)
+		measure(prefix.."getDrawableData"..suffix, setupModel, function(s)
+			s.model:getDrawableData(named)
+		end)
+		measure(prefix.."getDynamicDrawableData"..suffix, setupModel, function(s)
+			s.model:getDynamicDrawableData(named)
+		end)
+		-- Typical per-frame usage: reuse table, vertices change every frame
+		measure(prefix.."getDynamicDrawableData"..suffix.."/reuse", setupModel, function(s)
+			s.value = s.value == 0.5 and -0.5 or 0.5
+			local values = s.values or s.model:getParameterValues()
+			s.values = values
+			for i = 1, #values do values[i] = s.value end
+			s.model:setParameterValues(values)
+			s.model:update()
+			s.table = s.model:getDynamicDrawableData(s.table or {}, named)
+			s.model:resetDynamicDrawableFlags()
+		end)
+		measure(prefix.."hitTestAll"..suffix, setupModel, function(s)
+			s.table = s.model:hitTestAll(0, 0, s.table or {}, named)
+		end)
+		measure(prefix.."cull"..suffix, setupModel, function(s)
+			s.table = s.model:cull({-0.5, -0.5, 1, 1}, nil, s.table or {}, named)
+		end)
+	end
+
+	measure(prefix.."resetDynamicDrawableFlags", setupModel, function(s)
+		s.model:resetDynamicDrawableFlags()
+	end)
+	measure(prefix.."getBounds", setupModel, function(s)
+		s.model:getBounds()
+	end)
+	measure(prefix.."hitTest", function()
+		local s = setupModel()
+		s.handles = {}
+		for i = 1, info[3] do s.handles[i] = i end
+		return s
+	end, function(s)
+		s.model:hitTest(0, 0, s.handles)
+	end)
+	measure(prefix.."hitTest/named", function()
+		local s = setupModel()
+		s.handles = {}
+		for i, drawable in ipairs(s.model:getDrawableData()) do s.handles[i] = drawable.name end
+		return s
+	end, function(s)
+		s.model:hitTest(0, 0, s.handles)
+	end)
+	-- Single thread so results don't depend on the machine core count
+	measure(prefix.."renderToBuffer", function()
+		local s = setupModel()
+		local texture = {width = 64, height = 64, data = string.rep("\255\128\64\255", 64 * 64)}
+		s.textures = {texture, texture}
+		return s
+	end, function(s)
+		s.pixels = s.model:renderToBuffer(256, 256, s.textures, nil, 1, s.pixels)
+	end)
+	-- 4 threads on output of a few tiles, where the per-call cost of handing work
+	-- to the threads shows
+	measure(prefix.."renderToBuffer/threads", function()
+		local s = setupModel()
+		local texture = {width = 64, height = 64, data = string.rep("\255\128\64\255", 64 * 64)}
+		s.textures = {texture, texture}
+		return s
+	end, function(s)
+		s.pixels = s.model:renderToBuffer(160, 160, s.textures, nil, 4, s.pixels)
+	end)
+	-- Streamed round trip: capture one frame, send it, play it back on a second model
+	measure(prefix.."recordReplay", function()
+		local s = setupModel()
+		s.target = newModel(info)
+		s.recorder = s.model:newRecorder()
+		s.player = s.target:newPlayer()
+		s.values = s.model:getParameterValues()
+		return s
+	end, function(s)
+		s.value = s.value == 0.5 and -0.5 or 0.5
+		for i = 1, #s.values do s.values[i] = s.value end
+		s.model:setParameterValues(s.values)
+		s.recorder:capture()
+		s.player:feed(s.recorder:flush())
+		s.player:nextFrame()
+		-- Spectator usage, the player stream must not grow across iterations
+		s.player:trim()
+	end)
+	measure(prefix.."snapshot", setupModel, function(s)
+		s.snap = s.model:snapshot(s.snap)
+	end)
+	measure(prefix.."restore", function()
+		local s = setupModel()
+		s.snap = s.model:snapshot()
+		return s
+	end, function(s)
+		s.model:restore(s.snap)
+	end)
+end
+
+-- Crowd of small models, importance falls off with distance
+for _, importance in ipairs({1, 0}) do
+	local name = importance == 1 and "crowd/update" or "crowd/schedulerStep"
+	measure(name, function()
+		local s = {models = {}, scheduler = core.newScheduler()}
+		for i = 1, 128 do
+			s.models[i] = newModel(models[1])
+			s.scheduler:add(s.models[i], importance == 1 and 1 or 1 / (1 + (i - 1) % 8))
+		end
+		return s
+	end, function(s)
+		s.value = s.value == 0.5 and -0.5 or 0.5
+		for _, model in ipairs(s.models) do
+			s.values = model:getParameterValues(s.values or {})
+			for i = 1, #s.values do s.values[i] = s.value end
+			model:setParameterValues(s.values)
+		end
+		s.scheduler:step()
+	end)
+end
+
+local function save(path)
+	local f = assert(io.open(path, "w"))
+	for _, r in ipairs(results) do
+		f:write(string.format("%s %.3f %.3f\n", r.name, r.nsPerOp, r.allocsPerOp))
+	end
+	f:close()
+end
+
+if options.save then
+	save(options.save)
+end
+
+if options.baseline then
+	-- First run, nothing to compare against yet
+	local f = io.open(options.baseline, "r")
+	if not(f) then
+		print("no baseline, saving results to "..options.baseline)
+		save(options.baseline)
+		return true
+	end
+	f:close()
+
+	local baseline = {}
+	for line in io.lines(options.baseline) do
+		local name, ns, allocs = line:match("^(%S+) (%S+) (%S+)$")
+		if name then
+			baseline[name] = {nsPerOp = tonumber(ns), allocsPerOp = tonumber(allocs)}
+		end
+	end
+
+	local ok = true
+	for _, r in ipairs(results) do
+		local b = baseline[r.name]
+		if b then
+			-- Allocation count is nearly deterministic, time is not. Lua string
+			-- table growth is amortized over however many iterations ran.
+			if r.allocsPerOp > b.allocsPerOp * 1.01 + 0.5 then
+				print(string.format("REGRESSION %s: %.2f allocs/op (baseline %.2f)", r.name, r.allocsPerOp, b.allocsPerOp))
+				ok = false
+			end
+			if r.nsPerOp > b.nsPerOp * (1 + options.tolerance) then
+				print(string.format("REGRESSION %s: %.1f ns/op (baseline %.1f)", r.name, r.nsPerOp, b.nsPerOp))
+				ok = false
+			end
+		end
+	end
+
+	return ok
+end
+
+return true
@@ -0,0 +1,485 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Synthetic Live2D Cubism Core. See Live2DCubismCore.h */
+
+/* std */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Live2DCubismCore.h"
+
+/* Canvas is 1024x1024 pixels, model space is -1..1 */
+#define STUB_CANVAS_SIZE 1024.0f
+#define STUB_ID_SIZE 16
+
+struct csmMoc
+{
+	csmStubMocInfo info;
+};
+
+struct csmModel
+{
+	const csmMoc *moc;
+	int parameterCount, partCount, drawableCount;
+
+	const char **parameterIds;
+	float *parameterMin, *parameterMax, *parameterDefault, *parameterValues;
+	/* Parameter values at last update */
+	float *parameterLast;
+
+	const char **partIds;
+	float *partOpacities, *partLast;
+	int *partParents;
+
+	const char **drawableIds;
+	csmFlags *constantFlags, *dynamicFlags;
+	int *textureIndices, *drawOrders, *renderOrders;
+	float *opacities;
+	int *maskCounts;
+	const int **masks;
+	int *maskData;
+	int *vertexCounts;
+	const csmVector2 **vertexPositions;
+	const csmVector2 **vertexUvs;
+	csmVector2 *positionData, *basePositionData, *uvData;
+	int *indexCounts;
+	const unsigned short **indices;
+	unsigned short *indexData;
+	int updated;
+};
+
+static csmLogFunction stubLogFunction = NULL;
+
+/* Grid size of each drawable mesh */
+static void stubGrid(const csmMoc *moc, int *gridX, int *gridY)
+{
+	int grid = (int) ceil(sqrt((double) moc->info.vertexCount));
+
+	*gridX = grid < 2 ? 2 : grid;
+	grid = ((int) moc->info.vertexCount + *gridX - 1) / *gridX;
+	*gridY = grid < 2 ? 2 : grid;
+}
+
+/* Reserve aligned space. Used to measure (base == 0) and to carve memory. */
+static void *stubTake(uintptr_t *cursor, size_t size)
+{
+	uintptr_t p = (*cursor + 15) & ~(uintptr_t) 15;
+	*cursor = p + size;
+	return (void *) p;
+}
+
+/* Returns size of model memory and carve it if model is not NULL */
+static size_t stubLayout(const csmMoc *moc, csmModel *model, uintptr_t base)
+{
+	uintptr_t cursor = base;
+	size_t P = moc->info.parameterCount, T = moc->info.partCount, D = moc->info.drawableCount, V, I;
+	csmModel temp, *m = model ? model : &temp;
+	int gx, gy;
+
+	stubGrid(moc, &gx, &gy);
+	V = (size_t) gx * gy;
+	I = (size_t) (gx - 1) * (gy - 1) * 6;
+
+	stubTake(&cursor, sizeof(csmModel));
+	m->parameterIds = (const char **) stubTake(&cursor, sizeof(char *) * P + STUB_ID_SIZE * P);
+	m->parameterMin = (float *) stubTake(&cursor, sizeof(float) * P);
+	m->parameterMax = (float *) stubTake(&cursor, sizeof(float) * P);
+	m->parameterDefault = (float *) stubTake(&cursor, sizeof(float) * P);
+	m->parameterValues = (float *) stubTake(&cursor, sizeof(float) * P);
+	m->parameterLast = (float *) stubTake(&cursor, sizeof(float) * P);
+	m->partIds = (const char **) stubTake(&cursor, sizeof(char *) * T + STUB_ID_SIZE * T);
+	m->partOpacities = (float *) stubTake(&cursor, sizeof(float) * T);
+	m->partLast = (float *) stubTake(&cursor, sizeof(float) * T);
+	m->partParents = (int *) stubTake(&cursor, sizeof(int) * T);
+	m->drawableIds = (const char **) stubTake(&cursor, sizeof(char *) * D + STUB_ID_SIZE * D);
+	m->constantFlags = (csmFlags *) stubTake(&cursor, D);
+	m->dynamicFlags = (csmFlags *) stubTake(&cursor, D);
+	m->textureIndices = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->drawOrders = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->renderOrders = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->opacities = (float *) stubTake(&cursor, sizeof(float) * D);
+	m->maskCounts = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->masks = (const int **) stubTake(&cursor, sizeof(int *) * D);
+	m->maskData = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->vertexCounts = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->vertexPositions = (const csmVector2 **) stubTake(&cursor, sizeof(csmVector2 *) * D);
+	m->vertexUvs = (const csmVector2 **) stubTake(&cursor, sizeof(csmVector2 *) * D);
+	m->positionData = (csmVector2 *) stubTake(&cursor, sizeof(csmVector2) * V * D);
+	m->basePositionData = (csmVector2 *) stubTake(&cursor, sizeof(csmVector2) * V * D);
+	m->uvData = (csmVector2 *) stubTake(&cursor, sizeof(csmVector2) * V * D);
+	m->indexCounts = (int *) stubTake(&cursor, sizeof(int) * D);
+	m->indices = (const unsigned short **) stubTake(&cursor, sizeof(unsigned short *) * D);
+	m->indexData = (unsigned short *) stubTake(&cursor, sizeof(unsigned short) * I * D);
+
+	return (size_t) (cursor - base);
+}
+
+static void stubIds(const char **ids, size_t count, const char *prefix)
+{
+	char *names = (char *) (ids + count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		snprintf(names + i * STUB_ID_SIZE, STUB_ID_SIZE, "%s%u", prefix, (unsigned int) i);
+		ids[i] = names + i * STUB_ID_SIZE;
+	}
+}
+
+csmVersion csmGetVersion(void)
+{
+	/* 3.0.0 */
+	return 0x03000000;
+}
+
+csmMocVersion csmGetLatestMocVersion(void)
+{
+	return csmMocVersion_30;
+}
+
+csmMocVersion csmGetMocVersion(const void *address, const unsigned int size)
+{
+	if (size < sizeof(csmStubMocInfo) || memcmp(address, "STUB", 4) != 0)
+		return csmMocVersion_Unknown;
+
+	return csmMocVersion_30;
+}
+
+csmLogFunction csmGetLogFunction(void)
+{
+	return stubLogFunction;
+}
+
+void csmSetLogFunction(csmLogFunction handler)
+{
+	stubLogFunction = handler;
+}
+
+csmMoc *csmReviveMocInPlace(void *address, const unsigned int size)
+{
+	csmMoc *moc = (csmMoc *) address;
+
+	if (csmGetMocVersion(address, size) == csmMocVersion_Unknown)
+	{
+		if (stubLogFunction)
+			stubLogFunction("[CSM] [E]csmReviveMocInPlace is failed. The moc is invalid.");
+		return NULL;
+	}
+
+	/* Indices are 16-bit */
+	if (
+		moc->info.drawableCount > 0x10000 || moc->info.vertexCount > 0x10000 ||
+		moc->info.parameterCount > 0x10000 || moc->info.partCount > 0x10000
+	)
+		return NULL;
+
+	return moc;
+}
+
+unsigned int csmGetSizeofModel(const csmMoc *moc)
+{
+	return (unsigned int) stubLayout(moc, NULL, 0) + 16;
+}
+
+csmModel *csmInitializeModelInPlace(const csmMoc *moc, void *address, const unsigned int size)
+{
+	csmModel *model = (csmModel *) address;
+	int P, T, D, V, gx, gy, columns;
+	float cellSize;
+
+	if (((uintptr_t) address & (csmAlignofModel - 1)) != 0 || size < csmGetSizeofModel(moc))
+		return NULL;
+
+	stubLayout(moc, model, (uintptr_t) address);
+	stubGrid(moc, &gx, &gy);
+	model->moc = moc;
+	P = model->parameterCount = (int) moc->info.parameterCount;
+	T = model->partCount = (int) moc->info.partCount;
+	D = model->drawableCount = (int) moc->info.drawableCount;
+	V = gx * gy;
+	stubIds(model->parameterIds, P, "Param");
+	stubIds(model->partIds, T, "Part");
+	stubIds(model->drawableIds, D, "ArtMesh");
+
+	for (int i = 0; i < P; i++)
+	{
+		model->parameterMin[i] = -1.0f;
+		model->parameterMax[i] = 1.0f;
+		model->parameterDefault[i] = model->parameterValues[i] = model->parameterLast[i] = 0.0f;
+	}
+
+	for (int i = 0; i < T; i++)
+	{
+		model->partOpacities[i] = model->partLast[i] = 1.0f;
+		model->partParents[i] = i == 0 ? -1 : (i - 1) / 2;
+	}
+
+	/* Drawables are laid out in a grid over the canvas */
+	columns = (int) ceil(sqrt((double) (D > 0 ? D : 1)));
+	cellSize = 2.0f / columns;
+
+	for (int d = 0; d < D; d++)
+	{
+		float x0 = -1.0f + (d % columns) * cellSize, y0 = -1.0f + (d / columns) * cellSize;
+		csmVector2 *pos = model->positionData + d * V, *base = model->basePositionData + d * V;
+		csmVector2 *uv = model->uvData + d * V;
+		unsigned short *index = model->indexData + (size_t) d * (gx - 1) * (gy - 1) * 6;
+
+		model->constantFlags[d] = (d % 2 ? csmIsDoubleSided : 0) |
+			(d % 11 == 5 ? csmBlendAdditive : 0) |
+			(d % 13 == 7 ? csmBlendMultiplicative : 0);
+		model->dynamicFlags[d] = csmIsVisible | csmVisibilityDidChange | csmOpacityDidChange |
+			csmDrawOrderDidChange | csmRenderOrderDidChange | csmVertexPositionsDidChange;
+		model->textureIndices[d] = d % 2;
+		model->drawOrders[d] = 500;
+		model->renderOrders[d] = d;
+		model->opacities[d] = 1.0f;
+		model->maskCounts[d] = 0;
+		model->masks[d] = model->maskData + d;
+		model->maskData[d] = d > 0 ? d - 1 : D - 1;
+
+		for (int y = 0; y < gy; y++)
+		{
+			for (int x = 0; x < gx; x++)
+			{
+				int i = y * gx + x;
+				uv[i].X = (float) x / (gx - 1);
+				uv[i].Y = (float) y / (gy - 1);
+				base[i].X = x0 + uv[i].X * cellSize * 0.8f;
+				base[i].Y = y0 + uv[i].Y * cellSize * 0.8f;
+				pos[i] = base[i];
+			}
+		}
+
+		/* Counter-clockwise triangles */
+		for (int y = 0; y < gy - 1; y++)
+		{
+			for (int x = 0; x < gx - 1; x++)
+			{
+				unsigned short i = (unsigned short) (y * gx + x);
+				*index++ = i;
+				*index++ = (unsigned short) (i + 1);
+				*index++ = (unsigned short) (i + gx + 1);
+				*index++ = i;
+				*index++ = (unsigned short) (i + gx + 1);
+				*index++ = (unsigned short) (i + gx);
+			}
+		}
+
+		model->vertexCounts[d] = V;
+		model->vertexPositions[d] = pos;
+		model->vertexUvs[d] = uv;
+		model->indexCounts[d] = (gx - 1) * (gy - 1) * 6;
+		model->indices[d] = model->indexData + (size_t) d * (gx - 1) * (gy - 1) * 6;
+	}
+
+	/* Spread masked drawables evenly */
+	for (unsigned int i = 0; i < moc->info.maskedDrawableCount && D > 1; i++)
+		model->maskCounts[(size_t) i * D / moc->info.maskedDrawableCount] = 1;
+
+	model->updated = 0;
+	return model;
+}
+
+void csmUpdateModel(csmModel *model)
+{
+	int P = model->parameterCount, T = model->partCount, V, gx, gy;
+
+	stubGrid(model->moc, &gx, &gy);
+	V = gx * gy;
+
+	for (int d = 0; d < model->drawableCount; d++)
+	{
+		int param = P > 0 ? d % P : -1, part = T > 0 ? d % T : -1;
+		float opacity = part >= 0 ? model->partOpacities[part] : 1.0f;
+
+		/* Deformation is driven by a single parameter */
+		if (!model->updated || (param >= 0 && model->parameterValues[param] != model->parameterLast[param]))
+		{
+			float value = param >= 0 ? model->parameterValues[param] : 0.0f;
+			const csmVector2 *base = model->basePositionData + (size_t) d * V;
+			csmVector2 *pos = model->positionData + (size_t) d * V;
+
+			for (int i = 0; i < V; i++)
+			{
+				pos[i].X = base[i].X + value * 0.05f * base[i].Y;
+				pos[i].Y = base[i].Y + value * 0.02f * (float) (i % 7);
+			}
+
+			model->dynamicFlags[d] |= csmVertexPositionsDidChange;
+		}
+
+		if (opacity != model->opacities[d])
+		{
+			model->dynamicFlags[d] |= csmOpacityDidChange;
+			if ((opacity > 0.0f) != (model->opacities[d] > 0.0f))
+				model->dynamicFlags[d] ^= csmIsVisible;
+			model->dynamicFlags[d] |= csmVisibilityDidChange;
+			model->opacities[d] = opacity;
+		}
+	}
+
+	memcpy(model->parameterLast, model->parameterValues, sizeof(float) * P);
+	memcpy(model->partLast, model->partOpacities, sizeof(float) * T);
+	model->updated = 1;
+}
+
+void csmReadCanvasInfo(const csmModel *model, csmVector2 *outSizeInPixels, csmVector2 *outOriginInPixels, float *outPixelsPerUnit)
+{
+	(void) model;
+	outSizeInPixels->X = outSizeInPixels->Y = STUB_CANVAS_SIZE;
+	outOriginInPixels->X = outOriginInPixels->Y = STUB_CANVAS_SIZE * 0.5f;
+	*outPixelsPerUnit = STUB_CANVAS_SIZE * 0.5f;
+}
+
+int csmGetParameterCount(const csmModel *model)
+{
+	return model->parameterCount;
+}
+
+const char **csmGetParameterIds(const csmModel *model)
+{
+	return model->parameterIds;
+}
+
+const float *csmGetParameterMinimumValues(const csmModel *model)
+{
+	return model->parameterMin;
+}
+
+const float *csmGetParameterMaximumValues(const csmModel *model)
+{
+	return model->parameterMax;
+}
+
+const float *csmGetParameterDefaultValues(const csmModel *model)
+{
+	return model->parameterDefault;
+}
+
+float *csmGetParameterValues(csmModel *model)
+{
+	return model->parameterValues;
+}
+
+int csmGetPartCount(const csmModel *model)
+{
+	return model->partCount;
+}
+
+const char **csmGetPartIds(const csmModel *model)
+{
+	return model->partIds;
+}
+
+float *csmGetPartOpacities(csmModel *model)
+{
+	return model->partOpacities;
+}
+
+const int *csmGetPartParentPartIndices(const csmModel *model)
+{
+	return model->partParents;
+}
+
+int csmGetDrawableCount(const csmModel *model)
+{
+	return model->drawableCount;
+}
+
+const char **csmGetDrawableIds(const csmModel *model)
+{
+	return model->drawableIds;
+}
+
+const csmFlags *csmGetDrawableConstantFlags(const csmModel *model)
+{
+	return model->constantFlags;
+}
+
+const csmFlags *csmGetDrawableDynamicFlags(const csmModel *model)
+{
+	return model->dynamicFlags;
+}
+
+const int *csmGetDrawableTextureIndices(const csmModel *model)
+{
+	return model->textureIndices;
+}
+
+const int *csmGetDrawableDrawOrders(const csmModel *model)
+{
+	return model->drawOrders;
+}
+
+const int *csmGetDrawableRenderOrders(const csmModel *model)
+{
+	return model->renderOrders;
+}
+
+const float *csmGetDrawableOpacities(const csmModel *model)
+{
+	return model->opacities;
+}
+
+const int *csmGetDrawableMaskCounts(const csmModel *model)
+{
+	return model->maskCounts;
+}
+
+const int **csmGetDrawableMasks(const csmModel *model)
+{
+	return model->masks;
+}
+
+const int *csmGetDrawableVertexCounts(const csmModel *model)
+{
+	return model->vertexCounts;
+}
+
+const csmVector2 **csmGetDrawableVertexPositions(const csmModel *model)
+{
+	return model->vertexPositions;
+}
+
+const csmVector2 **csmGetDrawableVertexUvs(const csmModel *model)
+{
+	return model->vertexUvs;
+}
+
+const int *csmGetDrawableIndexCounts(const csmModel *model)
+{
+	return model->indexCounts;
+}
+
+const unsigned short **csmGetDrawableIndices(const csmModel *model)
+{
+	return model->indices;
+}
+
+void csmResetDrawableDynamicFlags(csmModel *model)
+{
+	for (int d = 0; d < model->drawableCount; d++)
+		model->dynamicFlags[d] &= csmIsVisible;
+}
@@ -0,0 +1,148 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Synthetic stand-in for Live2D Cubism Core, for benchmarking and CI only. */
+/* It implements the same API as the proprietary Live2DCubismCore.h, but the */
+/* "moc" is a csmStubMocInfo describing size of the synthetic model. */
+
+#ifndef LIVE2D_CUBISM_CORE_STUB_H
+#define LIVE2D_CUBISM_CORE_STUB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Alignment constraints */
+#define csmAlignofMoc 64
+#define csmAlignofModel 16
+
+/* Bit masks for non-dynamic drawable flags */
+enum
+{
+	csmBlendAdditive = 1 << 0,
+	csmBlendMultiplicative = 1 << 1,
+	csmIsDoubleSided = 1 << 2
+};
+
+/* Bit masks for dynamic drawable flags */
+enum
+{
+	csmIsVisible = 1 << 0,
+	csmVisibilityDidChange = 1 << 1,
+	csmOpacityDidChange = 1 << 2,
+	csmDrawOrderDidChange = 1 << 3,
+	csmRenderOrderDidChange = 1 << 4,
+	csmVertexPositionsDidChange = 1 << 5
+};
+
+/* Moc versions */
+enum
+{
+	csmMocVersion_Unknown = 0,
+	csmMocVersion_30 = 1
+};
+
+typedef struct csmMoc csmMoc;
+typedef struct csmModel csmModel;
+typedef unsigned int csmVersion;
+typedef unsigned int csmMocVersion;
+typedef unsigned char csmFlags;
+
+typedef struct csmVector2
+{
+	float X;
+	float Y;
+} csmVector2;
+
+typedef void (*csmLogFunction)(const char *message);
+
+/* Synthetic moc. Pass this struct (as bytes) as moc file. */
+typedef struct csmStubMocInfo
+{
+	/* "STUB" */
+	char magic[4];
+	unsigned int parameterCount;
+	unsigned int partCount;
+	unsigned int drawableCount;
+	/* Approximate vertices per drawable, rounded up to a grid */
+	unsigned int vertexCount;
+	/* Amount of drawables which are clipped by mask */
+	unsigned int maskedDrawableCount;
+} csmStubMocInfo;
+
+/* Version */
+csmVersion csmGetVersion(void);
+csmMocVersion csmGetLatestMocVersion(void);
+csmMocVersion csmGetMocVersion(const void *address, const unsigned int size);
+
+/* Logging */
+csmLogFunction csmGetLogFunction(void);
+void csmSetLogFunction(csmLogFunction handler);
+
+/* Moc */
+csmMoc *csmReviveMocInPlace(void *address, const unsigned int size);
+
+/* Model */
+unsigned int csmGetSizeofModel(const csmMoc *moc);
+csmModel *csmInitializeModelInPlace(const csmMoc *moc, void *address, const unsigned int size);
+void csmUpdateModel(csmModel *model);
+
+/* Canvas */
+void csmReadCanvasInfo(const csmModel *model, csmVector2 *outSizeInPixels, csmVector2 *outOriginInPixels, float *outPixelsPerUnit);
+
+/* Parameters */
+int csmGetParameterCount(const csmModel *model);
+const char **csmGetParameterIds(const csmModel *model);
+const float *csmGetParameterMinimumValues(const csmModel *model);
+const float *csmGetParameterMaximumValues(const csmModel *model);
+const float *csmGetParameterDefaultValues(const csmModel *model);
+float *csmGetParameterValues(csmModel *model);
+
+/* Parts */
+int csmGetPartCount(const csmModel *model);
+const char **csmGetPartIds(const csmModel *model);
+float *csmGetPartOpacities(csmModel *model);
+const int *csmGetPartParentPartIndices(const csmModel *model);
+
+/* Drawables */
+int csmGetDrawableCount(const csmModel *model);
+const char **csmGetDrawableIds(const csmModel *model);
+const csmFlags *csmGetDrawableConstantFlags(const csmModel *model);
+const csmFlags *csmGetDrawableDynamicFlags(const csmModel *model);
+const int *csmGetDrawableTextureIndices(const csmModel *model);
+const int *csmGetDrawableDrawOrders(const csmModel *model);
+const int *csmGetDrawableRenderOrders(const csmModel *model);
+const float *csmGetDrawableOpacities(const csmModel *model);
+const int *csmGetDrawableMaskCounts(const csmModel *model);
+const int **csmGetDrawableMasks(const csmModel *model);
+const int *csmGetDrawableVertexCounts(const csmModel *model);
+const csmVector2 **csmGetDrawableVertexPositions(const csmModel *model);
+const csmVector2 **csmGetDrawableVertexUvs(const csmModel *model);
+const int *csmGetDrawableIndexCounts(const csmModel *model);
+const unsigned short **csmGetDrawableIndices(const csmModel *model);
+void csmResetDrawableDynamicFlags(csmModel *model);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
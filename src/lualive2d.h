@@ -0,0 +1,230 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#ifndef _LUALIVE2D_H_
+#define _LUALIVE2D_H_
+
+/* Lua */
+#include "lua.h"
+#include "lauxlib.h"
+
+/* Live2D */
+#include "Live2DCubismCore.h"
+
+/* SIMD */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUALIVE2D_SSE
+#define LUALIVE2D_SSE2
+#include <emmintrin.h>
+#elif defined(__SSE__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LUALIVE2D_SSE
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LUALIVE2D_NEON
+#include <arm_neon.h>
+#endif
+
+#ifndef LUALIVE2D_METATABLE_NAME
+#define LUALIVE2D_METATABLE_NAME "Live2DModel*"
+#endif
+
+/* Hit-test grid dimension (cells in each axis) */
+#define HITGRID_SIZE 16
+
+/* Drawable blending mode */
+#define LUALIVE2D_BLEND_NORMAL 0
+#define LUALIVE2D_BLEND_ADD 1
+#define LUALIVE2D_BLEND_MULTIPLY 2
+
+/* Profiled functions, must match profileNames in profile.c */
+#define LUALIVE2D_PROFILE_LOADMODEL 0
+#define LUALIVE2D_PROFILE_UPDATE 1
+#define LUALIVE2D_PROFILE_CSMUPDATEMODEL 2
+#define LUALIVE2D_PROFILE_GETPARAMETERDEFAULT 3
+#define LUALIVE2D_PROFILE_GETPARAMETERVALUES 4
+#define LUALIVE2D_PROFILE_SETPARAMETERVALUES 5
+#define LUALIVE2D_PROFILE_GETPARTSDATA 6
+#define LUALIVE2D_PROFILE_GETPARTSOPACITY 7
+#define LUALIVE2D_PROFILE_GETDRAWABLEDATA 8
+#define LUALIVE2D_PROFILE_GETDYNAMICDRAWABLEDATA 9
+#define LUALIVE2D_PROFILE_RESETDYNAMICDRAWABLEFLAGS 10
+#define LUALIVE2D_PROFILE_HITTEST 11
+#define LUALIVE2D_PROFILE_HITTESTALL 12
+#define LUALIVE2D_PROFILE_CULL 13
+#define LUALIVE2D_PROFILE_RENDERTOBUFFER 14
+#define LUALIVE2D_PROFILE_SNAPSHOT 15
+#define LUALIVE2D_PROFILE_RESTORE 16
+#define LUALIVE2D_PROFILE_SCHEDULERSTEP 17
+#define LUALIVE2D_PROFILE_GETSTATICMESHDATA 18
+#define LUALIVE2D_PROFILE_COUNT 19
+
+/* Accumulated counters of single profiled function. Tables and strings are */
+/* estimates counted by hand at each creation site, not measured allocations. */
+typedef struct ProfileCounter
+{
+	unsigned long long calls, time, vertices, bytes, tables, strings;
+} ProfileCounter;
+
+/* In-flight profiled call */
+typedef struct ProfileScope
+{
+	unsigned long long start;
+	unsigned int vertices, bytes, tables, strings;
+} ProfileScope;
+
+/* Uniform grid to accelerate hit-testing. Each cell holds bitset of drawables */
+/* which bounds overlaps the cell. */
+typedef struct HitTestGrid
+{
+	/* Cell rectangle each drawable is inserted into, 4 ints per drawable, -1 if none */
+	int *cellRect;
+	/* Non-zero if drawable vertex positions has changed since last refresh */
+	unsigned char *dirty;
+	/* HITGRID_SIZE * HITGRID_SIZE cells, wordsPerCell words each */
+	unsigned int *cells;
+	int wordsPerCell, anyDirty;
+	/* Grid rectangle, it's recomputed when the model bounds leaves it */
+	float minX, minY, maxX, maxY, invCellW, invCellH;
+} HitTestGrid;
+
+/* Level-of-detail state of a model which is managed by scheduler. Vertex */
+/* positions of the last two real updates are kept, and the positions */
+/* consumers see are interpolated between them. */
+typedef struct ModelLOD
+{
+	/* Vertex positions of the last two updates and the interpolated output, */
+	/* indexed by vertexOffset */
+	csmVector2 *prev, *last, *out;
+	/* Vertex positions seen by consumers, 1 per drawable */
+	const csmVector2 **positions;
+	/* Drawable bounds of the last two updates, 4 floats per drawable */
+	float *prevBounds, *lastBounds;
+	int *vertexOffset;
+	/* Non-zero if drawable vertices differ between the last two updates */
+	unsigned char *moving;
+	/* Non-zero if interpolated vertex positions changed since flags reset */
+	unsigned char *changed;
+	/* Interpolation factor, 1 means last update */
+	float alpha;
+	/* Non-zero if positions must be recomputed */
+	int dirty;
+	/* Non-zero if the next update jumps to the new pose without interpolating */
+	int reset;
+	/* Scheduling: update every "interval" steps, "phase" steps since last update */
+	int interval, phase, cost;
+} ModelLOD;
+
+/* Per-drawable record of getStaticMeshData, in native byte order. Offsets and */
+/* counts are in elements of the respective blob. */
+typedef struct StaticMeshRecord
+{
+	unsigned int vertexOffset, vertexCount;
+	unsigned int indexOffset, indexCount;
+	unsigned int maskOffset, maskCount;
+	/* 0-based texture index, -1 if none */
+	short texture;
+	/* LUALIVE2D_BLEND_* */
+	unsigned char blending;
+	/* Bit 0: double sided */
+	unsigned char flags;
+} StaticMeshRecord;
+
+/* Struct for the metadata */
+typedef struct ModelDefinition
+{
+	void *mocMemory, *mocMemoryAligned;
+	csmMoc *moc;
+	void *modelMemory, *modelMemoryAligned;
+	csmModel *model;
+	csmVector2 modelDimensions, modelCenter;
+	float modelDPI;
+	/* Drawable bounds, 4 floats (minX, minY, maxX, maxY) per drawable */
+	float *drawableBounds;
+	/* Union of all drawable bounds */
+	float modelBounds[4];
+	/* Scratch buffer, 1 int per drawable */
+	int *drawableScratch;
+	HitTestGrid *hitGrid;
+	/* Non-NULL if model is managed by scheduler */
+	ModelLOD *lod;
+	/* 64-bit FNV-1a hash and size of the moc file, taken at load. Models with */
+	/* equal hash and size share their static mesh data. */
+	unsigned long long mocHash;
+	size_t mocSize;
+	/* Registry reference to the static mesh data, LUA_NOREF until requested */
+	int staticMeshRef;
+	/* Registry reference to drawable ID to 0-based index table, LUA_NOREF */
+	/* until a drawable is first looked up by name */
+	int drawableIndexRef;
+#ifdef LUALIVE2D_PROFILE
+	ProfileCounter profile[LUALIVE2D_PROFILE_COUNT];
+#endif
+} ModelDefinition;
+
+/* profile.c */
+#ifdef LUALIVE2D_PROFILE
+extern int l2dprof_enabled;
+unsigned long long l2dprof_begin(void);
+void l2dprof_end(ModelDefinition *model, int id, const ProfileScope *scope);
+
+/* Instrumentation is cheap when disabled at runtime: the flag is tested inline */
+/* and nothing is called out of line */
+#define PROFILE_BEGIN(scope) ProfileScope scope = {l2dprof_enabled ? l2dprof_begin() : 0, 0, 0, 0, 0}
+#define PROFILE_ADD(scope, field, n) ((scope).field += (unsigned int) (n))
+#define PROFILE_END(scope, model, id) ((scope).start ? l2dprof_end((model), (id), &(scope)) : (void) 0)
+#else
+#define PROFILE_BEGIN(scope) ((void) 0)
+#define PROFILE_ADD(scope, field, n) ((void) 0)
+#define PROFILE_END(scope, model, id) ((void) 0)
+#endif
+
+extern const luaL_Reg l2dprof_export[];
+int l2dw_getStats(lua_State *L);
+int l2dw_resetStats(lua_State *L);
+
+/* main.c */
+void l2dh_newmetatable(lua_State *L, const char *name, const luaL_Reg *methods);
+void l2dh_opttransform(lua_State *L, int idx, float *transform);
+int l2dh_blendmode(csmFlags flags);
+void l2dh_updatemodel(ModelDefinition *model);
+void l2dh_markbounds(ModelDefinition *model, int index);
+void l2dh_updatemodelbounds(ModelDefinition *model);
+
+/* render.c */
+int l2dw_renderToBuffer(lua_State *L);
+void l2d_openrender(lua_State *L);
+
+/* record.c */
+int l2dw_newRecorder(lua_State *L);
+int l2dw_newPlayer(lua_State *L);
+void l2d_openrecorder(lua_State *L);
+
+/* schedule.c */
+const csmVector2 **l2dh_vertexpositions(ModelDefinition *model);
+void l2dh_lodcapture(ModelDefinition *model);
+void l2dh_lodsetalpha(ModelDefinition *model, float alpha);
+void l2dh_lodreset(ModelDefinition *model);
+void l2dh_freelod(ModelDefinition *model);
+int l2d_newScheduler(lua_State *L);
+void l2d_openscheduler(lua_State *L);
+
+#endif
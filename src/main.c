@@ -21,6 +21,7 @@
  **/
 
 /* std */
+#include <float.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,8 +29,8 @@
 #include "lua.h"
 #include "lauxlib.h"
 
-/* Live2D */
-#include "Live2DCubismCore.h"
+/* lua-live2d */
+#include "lualive2d.h"
 
 /* It is always win32 that forces dllexport duh */
 #if defined(_WIN32) && !defined(LUALIVE2D_EMBEDDED)
@@ -38,23 +39,24 @@
 #define EXPORT_SIGNATURE
 #endif
 
-#ifndef LUALIVE2D_METATABLE_NAME
-#define LUALIVE2D_METATABLE_NAME "Live2DModel*"
+#ifndef LUALIVE2D_SNAPSHOT_METATABLE_NAME
+#define LUALIVE2D_SNAPSHOT_METATABLE_NAME "Live2DSnapshot*"
+#endif
+
+/* Registry key of the static mesh data cache, keyed by mesh data hash */
+#ifndef LUALIVE2D_STATICMESH_CACHE_NAME
+#define LUALIVE2D_STATICMESH_CACHE_NAME "Live2DStaticMesh"
 #endif
 
 /* This define align memory */
-#define ALIGN_TO_N(ptr, n) ((size_t) (ptr) + (n - 1) & (~(size_t) (n - 1)))
+#define ALIGN_TO_N(ptr, n) (((size_t) (ptr) + (n - 1)) & (~(size_t) (n - 1)))
 
-/* Struct for the metadata */
-typedef struct ModelDefinition
+/* Model state snapshot. Values are parameter values followed by part opacities. */
+typedef struct ModelSnapshot
 {
-	void *mocMemory, *mocMemoryAligned;
-	csmMoc *moc;
-	void *modelMemory, *modelMemoryAligned;
-	csmModel *model;
-	csmVector2 modelDimensions, modelCenter;
-	float modelDPI;
-} ModelDefinition;
+	int paramCount, partCount;
+	float values[1];
+} ModelSnapshot;
 
 typedef union FunctionString
 {
@@ -62,6 +64,25 @@ typedef union FunctionString
 	const char str[sizeof(void*)];
 } FunctionString;
 
+/* Create metatable and leave nothing on the stack. Metamethods goes to */
+/* the metatable, the rest goes to __index. */
+void l2dh_newmetatable(lua_State *L, const char *name, const luaL_Reg *methods)
+{
+	luaL_newmetatable(L, name);
+	lua_pushlstring(L, "__index", 7);
+	lua_newtable(L);
+
+	for (; methods->name != NULL; methods++)
+	{
+		lua_pushstring(L, methods->name);
+		lua_pushcfunction(L, methods->func);
+		lua_rawset(L, strncmp(methods->name, "__", 2) == 0 ? -5 : -3);
+	}
+
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
 static int l2dh_istrue(lua_State *L, int idx)
 {
 	int type = lua_type(L, idx);
@@ -82,13 +103,451 @@ static int l2dh_istrue(lua_State *L, int idx)
 	}
 }
 
+static void l2dh_freehitgrid(HitTestGrid *grid)
+{
+	if (grid)
+	{
+		free(grid->cellRect);
+		free(grid->dirty);
+		free(grid->cells);
+		free(grid);
+	}
+}
+
+static void l2dh_computebounds(const csmVector2 *vertex, int vertexCount, float *bounds)
+{
+	int i = 0;
+
+#if defined(LUALIVE2D_SSE)
+	/* Vertices are interleaved so lanes are {x, y, x, y} */
+	__m128 vmin = _mm_set1_ps(FLT_MAX), vmax = _mm_set1_ps(-FLT_MAX);
+	const float *v = (const float *) vertex;
+
+	for (; i + 4 <= vertexCount; i += 4)
+	{
+		__m128 a = _mm_loadu_ps(v + i * 2);
+		__m128 b = _mm_loadu_ps(v + i * 2 + 4);
+		vmin = _mm_min_ps(vmin, _mm_min_ps(a, b));
+		vmax = _mm_max_ps(vmax, _mm_max_ps(a, b));
+	}
+
+	vmin = _mm_min_ps(vmin, _mm_movehl_ps(vmin, vmin));
+	vmax = _mm_max_ps(vmax, _mm_movehl_ps(vmax, vmax));
+	_mm_storel_pi((__m64 *) bounds, vmin);
+	_mm_storel_pi((__m64 *) (bounds + 2), vmax);
+#elif defined(LUALIVE2D_NEON)
+	float32x4_t vmin = vdupq_n_f32(FLT_MAX), vmax = vdupq_n_f32(-FLT_MAX);
+	const float *v = (const float *) vertex;
+
+	for (; i + 4 <= vertexCount; i += 4)
+	{
+		float32x4_t a = vld1q_f32(v + i * 2);
+		float32x4_t b = vld1q_f32(v + i * 2 + 4);
+		vmin = vminq_f32(vmin, vminq_f32(a, b));
+		vmax = vmaxq_f32(vmax, vmaxq_f32(a, b));
+	}
+
+	vst1_f32(bounds, vmin_f32(vget_low_f32(vmin), vget_high_f32(vmin)));
+	vst1_f32(bounds + 2, vmax_f32(vget_low_f32(vmax), vget_high_f32(vmax)));
+#else
+	bounds[0] = bounds[1] = FLT_MAX;
+	bounds[2] = bounds[3] = -FLT_MAX;
+#endif
+
+	/* Remaining vertices */
+	for (; i < vertexCount; i++)
+	{
+		if (vertex[i].X < bounds[0]) bounds[0] = vertex[i].X;
+		if (vertex[i].Y < bounds[1]) bounds[1] = vertex[i].Y;
+		if (vertex[i].X > bounds[2]) bounds[2] = vertex[i].X;
+		if (vertex[i].Y > bounds[3]) bounds[3] = vertex[i].Y;
+	}
+}
+
+/* Mark drawable bounds as changed so the hit-test grid only refresh those */
+void l2dh_markbounds(ModelDefinition *model, int index)
+{
+	if (model->hitGrid)
+	{
+		model->hitGrid->dirty[index] = 1;
+		model->hitGrid->anyDirty = 1;
+	}
+}
+
+/* Recompute model bounds from the drawable bounds */
+void l2dh_updatemodelbounds(ModelDefinition *model)
+{
+	int drawCount = csmGetDrawableCount(model->model);
+	const int *drawVertexCount = csmGetDrawableVertexCounts(model->model);
+	float *modelBounds = model->modelBounds;
+
+	modelBounds[0] = modelBounds[1] = FLT_MAX;
+	modelBounds[2] = modelBounds[3] = -FLT_MAX;
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		const float *bounds = model->drawableBounds + i * 4;
+
+		if (drawVertexCount[i] > 0)
+		{
+			if (bounds[0] < modelBounds[0]) modelBounds[0] = bounds[0];
+			if (bounds[1] < modelBounds[1]) modelBounds[1] = bounds[1];
+			if (bounds[2] > modelBounds[2]) modelBounds[2] = bounds[2];
+			if (bounds[3] > modelBounds[3]) modelBounds[3] = bounds[3];
+		}
+	}
+
+	/* No vertices at all */
+	if (modelBounds[0] > modelBounds[2])
+		modelBounds[0] = modelBounds[1] = modelBounds[2] = modelBounds[3] = 0.0f;
+}
+
+/* Recompute bounds of drawables which vertices changed (or all if "all" is non-zero) */
+/* and the model bounds. */
+static void l2dh_updatebounds(ModelDefinition *model, int all)
+{
+	int drawCount = csmGetDrawableCount(model->model);
+	const int *drawVertexCount = csmGetDrawableVertexCounts(model->model);
+	const csmFlags *drawDynFlags = csmGetDrawableDynamicFlags(model->model);
+	const csmVector2 **drawVertex = csmGetDrawableVertexPositions(model->model);
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		if (all || (drawDynFlags[i] & csmVertexPositionsDidChange))
+		{
+			l2dh_computebounds(drawVertex[i], drawVertexCount[i], model->drawableBounds + i * 4);
+			l2dh_markbounds(model, i);
+		}
+	}
+
+	l2dh_updatemodelbounds(model);
+}
+
+/* Run csmUpdateModel and update everything that depends on vertex positions. */
+/* Scheduled models must set the interpolation factor afterwards. */
+void l2dh_updatemodel(ModelDefinition *model)
+{
+	PROFILE_BEGIN(profile);
+
+	csmUpdateModel(model->model);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_CSMUPDATEMODEL);
+
+	/* Drawable bounds may be interpolated ones, start from the last update */
+	if (model->lod)
+		memcpy(model->drawableBounds, model->lod->lastBounds, sizeof(float) * 4 * csmGetDrawableCount(model->model));
+
+	l2dh_updatebounds(model, 0);
+
+	if (model->lod)
+		l2dh_lodcapture(model);
+}
+
+static int l2dh_hitgridcell(float v, float min, float invCellSize)
+{
+	float c = (v - min) * invCellSize;
+
+	/* Points outside the grid belongs to the edge cells */
+	if (!(c >= 0.0f))
+		return 0;
+	else if (c >= (float) HITGRID_SIZE)
+		return HITGRID_SIZE - 1;
+	else
+		return (int) c;
+}
+
+static void l2dh_hitgridupdatecells(HitTestGrid *grid, int index, const int *newRect)
+{
+	int *oldRect = grid->cellRect + index * 4;
+	unsigned int bit = 1u << (index & 31);
+	int word = index >> 5;
+
+	if (memcmp(oldRect, newRect, sizeof(int) * 4) == 0)
+		return;
+
+	/* Remove from old cells */
+	if (oldRect[0] >= 0)
+	{
+		for (int y = oldRect[1]; y <= oldRect[3]; y++)
+			for (int x = oldRect[0]; x <= oldRect[2]; x++)
+				grid->cells[(y * HITGRID_SIZE + x) * grid->wordsPerCell + word] &= ~bit;
+	}
+
+	/* Insert to new cells */
+	if (newRect[0] >= 0)
+	{
+		for (int y = newRect[1]; y <= newRect[3]; y++)
+			for (int x = newRect[0]; x <= newRect[2]; x++)
+				grid->cells[(y * HITGRID_SIZE + x) * grid->wordsPerCell + word] |= bit;
+	}
+
+	memcpy(oldRect, newRect, sizeof(int) * 4);
+}
+
+/* Fit the grid to the current model bounds, with margin so a moving model doesn't */
+/* need new extent every update. Every drawable is reinserted on next refresh. */
+static void l2dh_hitgridextent(HitTestGrid *grid, const float *modelBounds, int drawCount)
+{
+	float marginX = (modelBounds[2] - modelBounds[0]) * 0.125f;
+	float marginY = (modelBounds[3] - modelBounds[1]) * 0.125f;
+
+	grid->minX = modelBounds[0] - marginX;
+	grid->minY = modelBounds[1] - marginY;
+	grid->maxX = modelBounds[2] + marginX;
+	grid->maxY = modelBounds[3] + marginY;
+	grid->invCellW = grid->maxX - grid->minX > 1e-6f ? HITGRID_SIZE / (grid->maxX - grid->minX) : 1.0f;
+	grid->invCellH = grid->maxY - grid->minY > 1e-6f ? HITGRID_SIZE / (grid->maxY - grid->minY) : 1.0f;
+	memset(grid->cells, 0, sizeof(unsigned int) * HITGRID_SIZE * HITGRID_SIZE * grid->wordsPerCell);
+	memset(grid->cellRect, 255, sizeof(int) * 4 * (drawCount + 1));
+	memset(grid->dirty, 1, drawCount + 1);
+	grid->anyDirty = 1;
+}
+
+/* Move changed drawables to their new cells */
+static void l2dh_refreshhitgrid(ModelDefinition *model)
+{
+	HitTestGrid *grid = model->hitGrid;
+	int drawCount = csmGetDrawableCount(model->model);
+	const int *drawVertexCount = csmGetDrawableVertexCounts(model->model);
+	const float *modelBounds = model->modelBounds;
+
+	/* Drawables outside the grid pile up in the edge cells and drawables in a */
+	/* model much smaller than the grid share few cells. Both degrade to linear scan. */
+	if (
+		modelBounds[0] < grid->minX || modelBounds[1] < grid->minY ||
+		modelBounds[2] > grid->maxX || modelBounds[3] > grid->maxY ||
+		(modelBounds[2] - modelBounds[0]) * 2.0f < grid->maxX - grid->minX ||
+		(modelBounds[3] - modelBounds[1]) * 2.0f < grid->maxY - grid->minY
+	)
+		l2dh_hitgridextent(grid, modelBounds, drawCount);
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		if (grid->dirty[i])
+		{
+			const float *bounds = model->drawableBounds + i * 4;
+			int rect[4] = {-1, -1, -1, -1};
+
+			if (drawVertexCount[i] > 0)
+			{
+				rect[0] = l2dh_hitgridcell(bounds[0], grid->minX, grid->invCellW);
+				rect[1] = l2dh_hitgridcell(bounds[1], grid->minY, grid->invCellH);
+				rect[2] = l2dh_hitgridcell(bounds[2], grid->minX, grid->invCellW);
+				rect[3] = l2dh_hitgridcell(bounds[3], grid->minY, grid->invCellH);
+			}
+
+			l2dh_hitgridupdatecells(grid, i, rect);
+			grid->dirty[i] = 0;
+		}
+	}
+
+	grid->anyDirty = 0;
+}
+
+/* Returns hit-test grid which is up-to-date with the current vertex positions */
+static HitTestGrid *l2dh_gethitgrid(lua_State *L, ModelDefinition *model)
+{
+	if (model->hitGrid == NULL)
+	{
+		HitTestGrid *grid;
+		int drawCount = csmGetDrawableCount(model->model);
+
+		grid = (HitTestGrid *) calloc(1, sizeof(HitTestGrid));
+		if (grid)
+		{
+			grid->wordsPerCell = (drawCount + 31) / 32;
+			grid->cellRect = (int *) malloc(sizeof(int) * 4 * (drawCount + 1));
+			grid->dirty = (unsigned char *) malloc(drawCount + 1);
+			grid->cells = (unsigned int *) calloc(HITGRID_SIZE * HITGRID_SIZE * grid->wordsPerCell + 1, sizeof(unsigned int));
+			if (grid->cellRect == NULL || grid->dirty == NULL || grid->cells == NULL)
+			{
+				l2dh_freehitgrid(grid);
+				grid = NULL;
+			}
+		}
+
+		/* Nothing may reference grid after it's freed */
+		if (grid == NULL)
+			luaL_error(L, "cannot allocate hit-test grid");
+
+		/* Grid covers the current model bounds */
+		l2dh_hitgridextent(grid, model->modelBounds, drawCount);
+		model->hitGrid = grid;
+	}
+
+	if (model->hitGrid->anyDirty)
+		l2dh_refreshhitgrid(model);
+
+	return model->hitGrid;
+}
+
+static int l2dh_pointintriangle(float x, float y, const csmVector2 *a, const csmVector2 *b, const csmVector2 *c)
+{
+	float d1 = (x - b->X) * (a->Y - b->Y) - (a->X - b->X) * (y - b->Y);
+	float d2 = (x - c->X) * (b->Y - c->Y) - (b->X - c->X) * (y - c->Y);
+	float d3 = (x - a->X) * (c->Y - a->Y) - (c->X - a->X) * (y - a->Y);
+
+	/* Accept both winding */
+	return !((d1 < 0.0f || d2 < 0.0f || d3 < 0.0f) && (d1 > 0.0f || d2 > 0.0f || d3 > 0.0f));
+}
+
+/* Test point against drawable mesh. Visibility must be checked by caller. */
+static int l2dh_drawablehit(ModelDefinition *model, int index, float x, float y, const csmVector2 *vertex, const unsigned short *drawIndex, int indexCount)
+{
+	const float *bounds = model->drawableBounds + index * 4;
+
+	if (x < bounds[0] || y < bounds[1] || x > bounds[2] || y > bounds[3])
+		return 0;
+
+	for (int i = 0; i + 2 < indexCount; i += 3)
+	{
+		if (l2dh_pointintriangle(x, y, &vertex[drawIndex[i]], &vertex[drawIndex[i + 1]], &vertex[drawIndex[i + 2]]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Read rectangle table {x, y, width, height} as {minX, minY, maxX, maxY} */
+static void l2dh_checkrect(lua_State *L, int idx, float *rect)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	for (int i = 0; i < 4; i++)
+	{
+		lua_rawgeti(L, idx, i + 1);
+		if (!lua_isnumber(L, -1))
+			luaL_argerror(L, idx, "invalid rectangle");
+		rect[i] = (float) lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	rect[2] += rect[0];
+	rect[3] += rect[1];
+}
+
+/* Read affine transform table {a, b, c, d, e, f} where */
+/* x' = a * x + c * y + e and y' = b * x + d * y + f. Identity if nil. */
+void l2dh_opttransform(lua_State *L, int idx, float *transform)
+{
+	if (lua_isnoneornil(L, idx))
+	{
+		transform[0] = transform[3] = 1.0f;
+		transform[1] = transform[2] = transform[4] = transform[5] = 0.0f;
+		return;
+	}
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	for (int i = 0; i < 6; i++)
+	{
+		lua_rawgeti(L, idx, i + 1);
+		if (!lua_isnumber(L, -1))
+			luaL_argerror(L, idx, "invalid transform");
+		transform[i] = (float) lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+}
+
+/* Transform bounds {minX, minY, maxX, maxY} and returns the bounds of the result */
+static void l2dh_transformbounds(const float *transform, const float *bounds, float *out)
+{
+	out[0] = out[1] = FLT_MAX;
+	out[2] = out[3] = -FLT_MAX;
+
+	for (int i = 0; i < 4; i++)
+	{
+		float x = bounds[(i & 1) ? 2 : 0];
+		float y = bounds[(i & 2) ? 3 : 1];
+		float tx = transform[0] * x + transform[2] * y + transform[4];
+		float ty = transform[1] * x + transform[3] * y + transform[5];
+
+		if (tx < out[0]) out[0] = tx;
+		if (ty < out[1]) out[1] = ty;
+		if (tx > out[2]) out[2] = tx;
+		if (ty > out[3]) out[3] = ty;
+	}
+}
+
+/* Returns one of LUALIVE2D_BLEND_* constant */
+int l2dh_blendmode(csmFlags flags)
+{
+	/* Both flags set is undefined, treat it as normal */
+	switch (flags & (csmBlendAdditive | csmBlendMultiplicative))
+	{
+		case csmBlendAdditive:
+			return LUALIVE2D_BLEND_ADD;
+		case csmBlendMultiplicative:
+			return LUALIVE2D_BLEND_MULTIPLY;
+		default:
+			return LUALIVE2D_BLEND_NORMAL;
+	}
+}
+
+/* Push drawable ID to 0-based index table, built on first call */
+static void l2dh_pushdrawableindices(lua_State *L, ModelDefinition *model)
+{
+	if (model->drawableIndexRef == LUA_NOREF)
+	{
+		int drawCount = csmGetDrawableCount(model->model);
+		const char **drawNames = csmGetDrawableIds(model->model);
+
+		/* Backwards, so the first of duplicate IDs wins */
+		lua_createtable(L, 0, drawCount);
+		for (int i = drawCount - 1; i >= 0; i--)
+		{
+			lua_pushstring(L, drawNames[i]);
+			lua_pushinteger(L, i);
+			lua_rawset(L, -3);
+		}
+
+		model->drawableIndexRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, model->drawableIndexRef);
+}
+
+/* Returns 0-based index of drawable which ID is the string at idx, -1 if not found */
+static int l2dh_finddrawable(lua_State *L, ModelDefinition *model, int idx)
+{
+	int index;
+
+	if (idx < 0 && idx > LUA_REGISTRYINDEX)
+		idx = lua_gettop(L) + idx + 1;
+
+	l2dh_pushdrawableindices(L, model);
+	lua_pushvalue(L, idx);
+	lua_rawget(L, -2);
+	index = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1) : -1;
+	lua_pop(L, 2);
+
+	return index;
+}
+
+/* 64-bit FNV-1a */
+static unsigned long long l2dh_hash(const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
 static int l2d_loadModel(lua_State *L)
 {
 	size_t mocSize;
 	unsigned int modelSize;
+	int drawCount;
 	const char *mocData;
 	ModelDefinition tempModel, *modelObject;
 
+	PROFILE_BEGIN(profile);
+
 	/* Need to get string contents of the moc */
 	mocData = luaL_checklstring(L, 1, &mocSize);
 
@@ -99,6 +558,11 @@ static int l2d_loadModel(lua_State *L)
 
 	tempModel.mocMemoryAligned = (void *) ALIGN_TO_N(tempModel.mocMemory, csmAlignofMoc);
 
+	/* Static mesh cache key. Hash the Lua string, reviving the moc modifies */
+	/* the moc memory. */
+	tempModel.mocHash = l2dh_hash(mocData, mocSize);
+	tempModel.mocSize = mocSize;
+
 	/* Load moc */
 	memcpy(tempModel.mocMemoryAligned, mocData, mocSize);
 	tempModel.moc = csmReviveMocInPlace(tempModel.mocMemoryAligned, (unsigned int) mocSize);
@@ -138,12 +602,37 @@ static int l2d_loadModel(lua_State *L)
 	/* Read canvas info */
 	csmReadCanvasInfo(tempModel.model, &tempModel.modelDimensions, &tempModel.modelCenter, &tempModel.modelDPI);
 
+	/* Allocate per-drawable buffers */
+	drawCount = csmGetDrawableCount(tempModel.model);
+	tempModel.drawableBounds = (float *) malloc(sizeof(float) * 4 * (drawCount + 1));
+	tempModel.drawableScratch = (int *) malloc(sizeof(int) * (drawCount + 1));
+	if (tempModel.drawableBounds == NULL || tempModel.drawableScratch == NULL)
+	{
+		free(tempModel.drawableScratch);
+		free(tempModel.drawableBounds);
+		free(tempModel.modelMemory);
+		free(tempModel.mocMemory);
+		luaL_error(L, "cannot allocate drawable memory");
+	}
+
+	/* Hit-test grid is created lazily */
+	tempModel.hitGrid = NULL;
+	tempModel.lod = NULL;
+	tempModel.staticMeshRef = LUA_NOREF;
+	tempModel.drawableIndexRef = LUA_NOREF;
+	l2dh_updatebounds(&tempModel, 1);
+#ifdef LUALIVE2D_PROFILE
+	memset(tempModel.profile, 0, sizeof(tempModel.profile));
+#endif
+
 	/* Create new Lua userdata */
 	modelObject = (ModelDefinition *) lua_newuserdata(L, sizeof(ModelDefinition));
 	memcpy(modelObject, &tempModel, sizeof(ModelDefinition));
 	luaL_getmetatable(L, LUALIVE2D_METATABLE_NAME);
 	lua_setmetatable(L, -2);
 
+	PROFILE_ADD(profile, bytes, mocSize + modelSize);
+	PROFILE_END(profile, modelObject, LUALIVE2D_PROFILE_LOADMODEL);
 	return 1;
 }
 
@@ -158,6 +647,14 @@ static int l2dw___tostring(lua_State *L)
 static int l2dw___gc(lua_State *L)
 {
 	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	l2dh_freelod(model);
+	l2dh_freehitgrid(model->hitGrid);
+	model->hitGrid = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, model->staticMeshRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, model->drawableIndexRef);
+	model->staticMeshRef = model->drawableIndexRef = LUA_NOREF;
+	free(model->drawableScratch);
+	free(model->drawableBounds);
 	free(model->modelMemory);
 	free(model->mocMemory);
 
@@ -167,8 +664,14 @@ static int l2dw___gc(lua_State *L)
 static int l2dw_update(lua_State *L)
 {
 	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
-	csmUpdateModel(model->model);
+	PROFILE_BEGIN(profile);
 
+	l2dh_updatemodel(model);
+	/* Explicit update shows the new state immediately */
+	if (model->lod)
+		l2dh_lodsetalpha(model, 1.0f);
+
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_UPDATE);
 	return 0;
 }
 
@@ -212,12 +715,15 @@ static int l2dw_getParameterDefault(lua_State *L)
 	const char **paramNames;
 	const float *paramMin, *paramMax, *paramDef;
 
+	PROFILE_BEGIN(profile);
+
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	paramCount = csmGetParameterCount(model->model);
 	paramNames = csmGetParameterIds(model->model);
 	paramMin = csmGetParameterMinimumValues(model->model);
 	paramMax = csmGetParameterMaximumValues(model->model);
 	paramDef = csmGetParameterDefaultValues(model->model);
+	PROFILE_ADD(profile, tables, !lua_istable(L, 2));
 	namedRet = l2dh_usertablenamed(L, 2, &tableIndex, paramCount);
 
 	if (namedRet)
@@ -279,6 +785,10 @@ static int l2dw_getParameterDefault(lua_State *L)
 
 	/* Push table index into stack and return that */
 	lua_pushvalue(L, tableIndex);
+	PROFILE_ADD(profile, tables, paramCount);
+	PROFILE_ADD(profile, strings, paramCount);
+	PROFILE_ADD(profile, bytes, sizeof(float) * 3 * paramCount);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETPARAMETERDEFAULT);
 	return 1;
 }
 
@@ -289,9 +799,12 @@ static int l2dw_getParameterValues(lua_State *L)
 	const char **paramNames;
 	float *paramValues;
 
+	PROFILE_BEGIN(profile);
+
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	paramCount = csmGetParameterCount(model->model);
 	paramValues = csmGetParameterValues(model->model);
+	PROFILE_ADD(profile, tables, !lua_istable(L, 2));
 	namedRet = l2dh_usertablenamed(L, 2, &tableIndex, paramCount);
 
 	if (namedRet)
@@ -316,6 +829,9 @@ static int l2dw_getParameterValues(lua_State *L)
 	}
 
 	lua_pushvalue(L, tableIndex);
+	PROFILE_ADD(profile, strings, namedRet ? paramCount : 0);
+	PROFILE_ADD(profile, bytes, sizeof(float) * paramCount);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETPARAMETERVALUES);
 	return 1;
 }
 
@@ -326,6 +842,8 @@ static int l2dw_setParameterValues(lua_State *L)
 	const char **paramNames;
 	float *paramValues;
 
+	PROFILE_BEGIN(profile);
+
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	paramCount = csmGetParameterCount(model->model);
 	paramValues = csmGetParameterValues(model->model);
@@ -357,6 +875,9 @@ static int l2dw_setParameterValues(lua_State *L)
 		}
 	}
 
+	PROFILE_ADD(profile, strings, namedRet ? paramCount : 0);
+	PROFILE_ADD(profile, bytes, sizeof(float) * paramCount);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_SETPARAMETERVALUES);
 	return 0;
 }
 
@@ -367,10 +888,13 @@ static int l2dw_getPartsData(lua_State *L)
 	const int *partParent;
 	const char **partNames;
 
+	PROFILE_BEGIN(profile);
+
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	partCount = csmGetPartCount(model->model);
 	partNames = csmGetPartIds(model->model);
 	partParent = csmGetPartParentPartIndices(model->model);
+	PROFILE_ADD(profile, tables, !lua_istable(L, 2));
 	namedRet = l2dh_usertablenamed(L, 2, &tableIndex, partCount);
 
 	if (namedRet)
@@ -391,6 +915,8 @@ static int l2dw_getPartsData(lua_State *L)
 				lua_pushstring(L, partNames[partParent[i]]);
 				lua_rawset(L, -3);
 			}
+
+			lua_rawset(L, tableIndex);
 		}
 	}
 	else
@@ -417,7 +943,10 @@ static int l2dw_getPartsData(lua_State *L)
 	}
 
 	lua_pushvalue(L, tableIndex);
-	return 2;
+	PROFILE_ADD(profile, tables, partCount);
+	PROFILE_ADD(profile, strings, partCount);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETPARTSDATA);
+	return 1;
 }
 
 static int l2dw_getPartsOpacity(lua_State *L)
@@ -427,9 +956,12 @@ static int l2dw_getPartsOpacity(lua_State *L)
 	const float *partOpacity;
 	const char **partNames;
 
+	PROFILE_BEGIN(profile);
+
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	partCount = csmGetPartCount(model->model);
 	partOpacity = csmGetPartOpacities(model->model);
+	PROFILE_ADD(profile, tables, !lua_istable(L, 2));
 	namedRet = l2dh_usertablenamed(L, 2, &tableIndex, partCount);
 
 	if (namedRet)
@@ -440,7 +972,7 @@ static int l2dw_getPartsOpacity(lua_State *L)
 		{
 			lua_pushstring(L, partNames[i]);
 			lua_pushnumber(L, partOpacity[i]);
-			lua_rawset(L, -3);
+			lua_rawset(L, tableIndex);
 		}
 	}
 	else
@@ -449,11 +981,14 @@ static int l2dw_getPartsOpacity(lua_State *L)
 		{
 			lua_pushinteger(L, i + 1);
 			lua_pushnumber(L, partOpacity[i]);
-			lua_rawset(L, -3);
+			lua_rawset(L, tableIndex);
 		}
 	}
 
 	lua_pushvalue(L, tableIndex);
+	PROFILE_ADD(profile, strings, namedRet ? partCount : 0);
+	PROFILE_ADD(profile, bytes, sizeof(float) * partCount);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETPARTSOPACITY);
 	return 1;
 }
 
@@ -466,7 +1001,8 @@ static int l2dw_getDrawableData(lua_State *L)
 	const int *drawIndexCount, *drawMaskCount, *drawTex, *drawVertCount, **drawMask;
 	const csmFlags *drawConstFlags;
 	const csmVector2 **drawUVs;
-	static csmFlags blendMulAndAdd = csmBlendAdditive | csmBlendAdditive;
+
+	PROFILE_BEGIN(profile);
 
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	drawCount = csmGetDrawableCount(model->model);
@@ -479,6 +1015,7 @@ static int l2dw_getDrawableData(lua_State *L)
 	drawMask = csmGetDrawableMasks(model->model);
 	drawConstFlags = csmGetDrawableConstantFlags(model->model);
 	drawUVs = csmGetDrawableVertexUvs(model->model);
+	PROFILE_ADD(profile, tables, !lua_istable(L, 2));
 	namedRet = l2dh_usertablenamed(L, 2, &tableIndex, drawCount);
 
 	for (i = 0; i < drawCount; i++)
@@ -508,12 +1045,18 @@ static int l2dw_getDrawableData(lua_State *L)
 		lua_pushlstring(L, "flags", 5);
 		lua_createtable(L, 0, 2);
 		lua_pushlstring(L, "blending", 8);
-		if ((drawConstFlags[i] & blendMulAndAdd) == blendMulAndAdd || (drawConstFlags[i] & blendMulAndAdd) == 0)
-			lua_pushlstring(L, "normal", 6);
-		else if (drawConstFlags[i] & csmBlendAdditive)
-			lua_pushlstring(L, "add", 3);
-		else if (drawConstFlags[i] & csmBlendMultiplicative)
-			lua_pushlstring(L, "multiply", 8);
+		switch (l2dh_blendmode(drawConstFlags[i]))
+		{
+			case LUALIVE2D_BLEND_ADD:
+				lua_pushlstring(L, "add", 3);
+				break;
+			case LUALIVE2D_BLEND_MULTIPLY:
+				lua_pushlstring(L, "multiply", 8);
+				break;
+			default:
+				lua_pushlstring(L, "normal", 6);
+				break;
+		}
 		lua_rawset(L, -3); /* blending */
 		lua_pushlstring(L, "doublesided", 11);
 		lua_pushboolean(L, drawConstFlags[i] & csmIsDoubleSided);
@@ -563,7 +1106,7 @@ static int l2dw_getDrawableData(lua_State *L)
 			lua_pushnumber(L, drawUVs[i][j].X);
 			lua_rawset(L, -3);
 			lua_pushinteger(L, j * 2 + 2);
-			lua_pushnumber(L, drawUVs[i][j].X);
+			lua_pushnumber(L, drawUVs[i][j].Y);
 			lua_rawset(L, -3);
 		}
 		lua_rawset(L, -3);
@@ -579,12 +1122,187 @@ static int l2dw_getDrawableData(lua_State *L)
 		lua_rawset(L, -3);
 
 		lua_rawset(L, tableIndex); /* end */
+
+		PROFILE_ADD(profile, tables, 4 + (drawMaskCount[i] > 0));
+		PROFILE_ADD(profile, strings, 1 + (namedRet ? drawMaskCount[i] : 0));
+		PROFILE_ADD(profile, vertices, drawVertCount[i]);
+		PROFILE_ADD(profile, bytes, sizeof(csmVector2) * drawVertCount[i] + sizeof(unsigned short) * drawIndexCount[i]);
 	}
 
 	lua_pushvalue(L, tableIndex);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETDRAWABLEDATA);
 	return 1;
 }
 
+/* Check static mesh table on top of the stack was built from the same moc. */
+/* The cache is keyed by the moc hash, size is compared to catch collisions. */
+static int l2dh_checkstaticmesh(lua_State *L, ModelDefinition *model)
+{
+	size_t hashSize;
+	const char *hash;
+	int match;
+
+	if (!lua_istable(L, -1))
+		return 0;
+
+	lua_rawgeti(L, -1, 5);
+	lua_rawgeti(L, -2, 6);
+	hash = lua_tolstring(L, -1, &hashSize);
+	match =
+		lua_isnumber(L, -2) && (size_t) lua_tonumber(L, -2) == model->mocSize &&
+		hash != NULL && hashSize == sizeof(model->mocHash) && memcmp(hash, &model->mocHash, hashSize) == 0;
+	lua_pop(L, 2);
+
+	return match;
+}
+
+/* Build static mesh blobs as {uv, indices, records, masks, moc size, moc hash} */
+/* table */
+static void l2dh_newstaticmesh(lua_State *L, ModelDefinition *model)
+{
+	int drawCount = csmGetDrawableCount(model->model);
+	const unsigned short **drawIndex = csmGetDrawableIndices(model->model);
+	const int *drawIndexCount = csmGetDrawableIndexCounts(model->model);
+	const int *drawMaskCount = csmGetDrawableMaskCounts(model->model);
+	const int *drawTex = csmGetDrawableTextureIndices(model->model);
+	const int *drawVertCount = csmGetDrawableVertexCounts(model->model);
+	const int **drawMask = csmGetDrawableMasks(model->model);
+	const csmFlags *drawConstFlags = csmGetDrawableConstantFlags(model->model);
+	const csmVector2 **drawUVs = csmGetDrawableVertexUvs(model->model);
+	size_t totalVertex = 0, totalIndex = 0, totalMask = 0, scratchSize;
+	StaticMeshRecord *records;
+	float *uv;
+	unsigned short *indices;
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		totalVertex += drawVertCount[i];
+		totalIndex += drawIndexCount[i];
+		totalMask += drawMaskCount[i];
+	}
+
+	/* Largest blob decides scratch size. Scratch is userdata so it's */
+	/* collected if pushing the blobs raise error. */
+	scratchSize = sizeof(StaticMeshRecord) * drawCount;
+	if (sizeof(float) * 2 * totalVertex > scratchSize)
+		scratchSize = sizeof(float) * 2 * totalVertex;
+	if (sizeof(unsigned short) * totalIndex > scratchSize)
+		scratchSize = sizeof(unsigned short) * totalIndex;
+	if (sizeof(unsigned short) * totalMask > scratchSize)
+		scratchSize = sizeof(unsigned short) * totalMask;
+
+	lua_createtable(L, 8, 0);
+	uv = (float *) lua_newuserdata(L, scratchSize + 1);
+
+	/* UVs, interleaved as x, y */
+	for (int i = 0, k = 0; i < drawCount; i++)
+	{
+		for (int j = 0; j < drawVertCount[i]; j++, k += 2)
+		{
+			uv[k] = drawUVs[i][j].X;
+			uv[k + 1] = drawUVs[i][j].Y;
+		}
+	}
+	lua_pushlstring(L, (const char *) uv, sizeof(float) * 2 * totalVertex);
+	lua_rawseti(L, -3, 1);
+
+	/* Indices, 0-based relative to its drawable vertices */
+	indices = (unsigned short *) uv;
+	for (int i = 0, k = 0; i < drawCount; i++)
+	{
+		memcpy(indices + k, drawIndex[i], sizeof(unsigned short) * drawIndexCount[i]);
+		k += drawIndexCount[i];
+	}
+	lua_pushlstring(L, (const char *) indices, sizeof(unsigned short) * totalIndex);
+	lua_rawseti(L, -3, 2);
+
+	/* Records */
+	records = (StaticMeshRecord *) uv;
+	for (int i = 0, vertexOffset = 0, indexOffset = 0, maskOffset = 0; i < drawCount; i++)
+	{
+		StaticMeshRecord *record = records + i;
+
+		record->vertexOffset = (unsigned int) vertexOffset;
+		record->vertexCount = (unsigned int) drawVertCount[i];
+		record->indexOffset = (unsigned int) indexOffset;
+		record->indexCount = (unsigned int) drawIndexCount[i];
+		record->maskOffset = (unsigned int) maskOffset;
+		record->maskCount = (unsigned int) drawMaskCount[i];
+		record->texture = (short) drawTex[i];
+		record->blending = (unsigned char) l2dh_blendmode(drawConstFlags[i]);
+		record->flags = (drawConstFlags[i] & csmIsDoubleSided) ? 1 : 0;
+
+		vertexOffset += drawVertCount[i];
+		indexOffset += drawIndexCount[i];
+		maskOffset += drawMaskCount[i];
+	}
+	lua_pushlstring(L, (const char *) records, sizeof(StaticMeshRecord) * drawCount);
+	lua_rawseti(L, -3, 3);
+
+	/* Masks, 0-based drawable index */
+	indices = (unsigned short *) uv;
+	for (int i = 0, k = 0; i < drawCount; i++)
+	{
+		for (int j = 0; j < drawMaskCount[i]; j++)
+			indices[k++] = (unsigned short) drawMask[i][j];
+	}
+	lua_pushlstring(L, (const char *) indices, sizeof(unsigned short) * totalMask);
+	lua_rawseti(L, -3, 4);
+
+	/* Scratch */
+	lua_pop(L, 1);
+
+	lua_pushnumber(L, (lua_Number) model->mocSize);
+	lua_rawseti(L, -2, 5);
+	lua_pushlstring(L, (const char *) &model->mocHash, sizeof(model->mocHash));
+	lua_rawseti(L, -2, 6);
+}
+
+static int l2dw_getStaticMeshData(lua_State *L)
+{
+	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	PROFILE_BEGIN(profile);
+
+	if (model->staticMeshRef == LUA_NOREF)
+	{
+		/* Other model from the same moc may have it */
+		lua_getfield(L, LUA_REGISTRYINDEX, LUALIVE2D_STATICMESH_CACHE_NAME);
+		lua_pushlstring(L, (const char *) &model->mocHash, sizeof(model->mocHash));
+		lua_rawget(L, -2);
+
+		/* Hash collision replaces the cached one */
+		if (!l2dh_checkstaticmesh(L, model))
+		{
+			lua_pop(L, 1);
+			l2dh_newstaticmesh(L, model);
+			lua_pushlstring(L, (const char *) &model->mocHash, sizeof(model->mocHash));
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -4);
+
+			PROFILE_ADD(profile, tables, 1);
+			PROFILE_ADD(profile, strings, 4);
+			for (int i = 1; i <= 4; i++)
+			{
+				lua_rawgeti(L, -1, i);
+				PROFILE_ADD(profile, bytes, lua_objlen(L, -1));
+				lua_pop(L, 1);
+			}
+		}
+
+		/* Keep it alive as long as this model lives */
+		lua_pushvalue(L, -1);
+		model->staticMeshRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	else
+		lua_rawgeti(L, LUA_REGISTRYINDEX, model->staticMeshRef);
+
+	for (int i = 1; i <= 4; i++)
+		lua_rawgeti(L, -i, i);
+
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETSTATICMESHDATA);
+	return 4;
+}
+
 static int l2dw_getDynamicDrawableData(lua_State *L)
 {
 	ModelDefinition *model;
@@ -595,6 +1313,8 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 	const float *drawOpacity;
 	const csmVector2 **drawVertex;
 
+	PROFILE_BEGIN(profile);
+
 	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
 	drawCount = csmGetDrawableCount(model->model);
 	drawNames = csmGetDrawableIds(model->model);
@@ -603,7 +1323,8 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 	drawVertexCount = csmGetDrawableVertexCounts(model->model);
 	drawDynFlags = csmGetDrawableDynamicFlags(model->model);
 	drawOpacity = csmGetDrawableOpacities(model->model);
-	drawVertex = csmGetDrawableVertexPositions(model->model);
+	drawVertex = l2dh_vertexpositions(model);
+	PROFILE_ADD(profile, tables, !lua_istable(L, 2));
 	namedRet = l2dh_usertablenamed(L, 2, &tableIndex, drawCount);
 
 	for (i = 0; i < drawCount; i++)
@@ -619,6 +1340,7 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 		{
 			lua_pop(L, 1);
 			lua_createtable(L, 0, 5);
+			PROFILE_ADD(profile, tables, 1);
 			if (namedRet)
 				lua_pushstring(L, drawNames[i]);
 			else
@@ -648,6 +1370,7 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 		{
 			lua_pop(L, 1);
 			lua_createtable(L, 0, 6);
+			PROFILE_ADD(profile, tables, 1);
 			/* Set the new table, leaving the new table at -1 */
 			lua_pushlstring(L, "dynamicFlags", 12);
 			lua_pushvalue(L, -2);
@@ -675,7 +1398,7 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 		lua_rawset(L, -3);
 		/* vertexChanged - Dynamic flags */
 		lua_pushlstring(L, "vertexChanged", 13);
-		lua_pushboolean(L, drawDynFlags[i] & csmVertexPositionsDidChange);
+		lua_pushboolean(L, (drawDynFlags[i] & csmVertexPositionsDidChange) || (model->lod && model->lod->changed[i]));
 		lua_rawset(L, -3);
 		/* remove the flags table */
 		lua_pop(L, 1);
@@ -687,14 +1410,21 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 			/* Always re-new vertex positions */
 			lua_pop(L, 1);
 			lua_createtable(L, drawVertexCount[i] * 2, 0);
+			PROFILE_ADD(profile, tables, 1);
 			/* Set the new table, leaving the new table at -1 */
 			lua_pushlstring(L, "vertexPosition", 14);
 			lua_pushvalue(L, -2);
 			lua_rawset(L, -4);
 		}
 
-		if (alwaysSetVertex || (drawDynFlags[i] & csmVertexPositionsDidChange))
+		if (
+			alwaysSetVertex || (drawDynFlags[i] & csmVertexPositionsDidChange) ||
+			(model->lod && model->lod->changed[i])
+		)
 		{
+			PROFILE_ADD(profile, vertices, drawVertexCount[i]);
+			PROFILE_ADD(profile, bytes, sizeof(csmVector2) * drawVertexCount[i]);
+
 			for (j = 0; j < drawVertexCount[i]; j++)
 			{
 				lua_pushinteger(L, j * 2 + 1);
@@ -710,19 +1440,391 @@ static int l2dw_getDynamicDrawableData(lua_State *L)
 	}
 
 	lua_pushvalue(L, tableIndex);
+	PROFILE_ADD(profile, strings, namedRet ? drawCount : 0);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_GETDYNAMICDRAWABLEDATA);
 	return 1;
 }
 
 static int l2dw_resetDynamicDrawableFlags(lua_State *L)
 {
 	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	PROFILE_BEGIN(profile);
+
 	csmResetDrawableDynamicFlags(model->model);
+	if (model->lod)
+		memset(model->lod->changed, 0, csmGetDrawableCount(model->model));
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_RESETDYNAMICDRAWABLEFLAGS);
+	return 0;
+}
+
+static int l2dw_hitTest(lua_State *L)
+{
+	ModelDefinition *model;
+	HitTestGrid *grid;
+	int drawCount, handleCount, best, bestOrder, index, i;
+	float x, y;
+	const unsigned int *cellBits;
+	const int *drawRenderOrder, *drawIndexCount;
+	const unsigned short **drawIndex;
+	const csmFlags *drawDynFlags;
+	const float *drawOpacity;
+	const csmVector2 **drawVertex;
+
+	PROFILE_BEGIN(profile);
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	x = (float) luaL_checknumber(L, 2);
+	y = (float) luaL_checknumber(L, 3);
+	luaL_checktype(L, 4, LUA_TTABLE);
+	grid = l2dh_gethitgrid(L, model);
+	drawCount = csmGetDrawableCount(model->model);
+	drawRenderOrder = csmGetDrawableRenderOrders(model->model);
+	drawIndexCount = csmGetDrawableIndexCounts(model->model);
+	drawIndex = csmGetDrawableIndices(model->model);
+	drawDynFlags = csmGetDrawableDynamicFlags(model->model);
+	drawOpacity = csmGetDrawableOpacities(model->model);
+	drawVertex = l2dh_vertexpositions(model);
+	cellBits = grid->cells + (
+		l2dh_hitgridcell(y, grid->minY, grid->invCellH) * HITGRID_SIZE +
+		l2dh_hitgridcell(x, grid->minX, grid->invCellW)
+	) * grid->wordsPerCell;
+	handleCount = (int) lua_objlen(L, 4);
+	best = 0;
+	bestOrder = 0;
+	lua_settop(L, 4);
+
+	for (i = 1; i <= handleCount; i++)
+	{
+		/* Handle can be drawable index or drawable name */
+		lua_rawgeti(L, 4, i);
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			index = (int) lua_tointeger(L, -1) - 1;
+		else if (lua_type(L, -1) == LUA_TSTRING)
+		{
+			/* Drawable ID lookup table goes to index 5 on first named handle */
+			if (lua_gettop(L) == 5)
+			{
+				lua_pop(L, 1);
+				l2dh_pushdrawableindices(L, model);
+				lua_rawgeti(L, 4, i);
+			}
+
+			lua_pushvalue(L, -1);
+			lua_rawget(L, 5);
+			index = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1) : -1;
+			lua_pop(L, 1);
+			if (index == -1)
+				luaL_error(L, "drawable '%s' does not exist", lua_tostring(L, -1));
+		}
+		else
+			index = -1;
+		lua_pop(L, 1);
+
+		if (index < 0 || index >= drawCount)
+			luaL_error(L, "invalid drawable handle at index %d", i);
+
+		/* Only test drawables which can be on top of the current best */
+		if (
+			(cellBits[index >> 5] & (1u << (index & 31))) &&
+			(best == 0 || drawRenderOrder[index] > bestOrder) &&
+			(drawDynFlags[index] & csmIsVisible) && drawOpacity[index] > 0.0f &&
+			l2dh_drawablehit(model, index, x, y, drawVertex[index], drawIndex[index], drawIndexCount[index])
+		)
+		{
+			best = i;
+			bestOrder = drawRenderOrder[index];
+		}
+	}
+
+	if (best > 0)
+		lua_rawgeti(L, 4, best);
+	else
+		lua_pushnil(L);
+
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_HITTEST);
+	return 1;
+}
+
+static int l2dw_hitTestAll(lua_State *L)
+{
+	ModelDefinition *model;
+	HitTestGrid *grid;
+	int drawCount, namedRet, tableIndex, hitCount, oldLen, i, j;
+	float x, y;
+	const unsigned int *cellBits;
+	const char **drawNames;
+	const int *drawRenderOrder, *drawIndexCount;
+	const unsigned short **drawIndex;
+	const csmFlags *drawDynFlags;
+	const float *drawOpacity;
+	const csmVector2 **drawVertex;
+
+	PROFILE_BEGIN(profile);
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	x = (float) luaL_checknumber(L, 2);
+	y = (float) luaL_checknumber(L, 3);
+	grid = l2dh_gethitgrid(L, model);
+	drawCount = csmGetDrawableCount(model->model);
+	drawNames = csmGetDrawableIds(model->model);
+	drawRenderOrder = csmGetDrawableRenderOrders(model->model);
+	drawIndexCount = csmGetDrawableIndexCounts(model->model);
+	drawIndex = csmGetDrawableIndices(model->model);
+	drawDynFlags = csmGetDrawableDynamicFlags(model->model);
+	drawOpacity = csmGetDrawableOpacities(model->model);
+	drawVertex = l2dh_vertexpositions(model);
+	cellBits = grid->cells + (
+		l2dh_hitgridcell(y, grid->minY, grid->invCellH) * HITGRID_SIZE +
+		l2dh_hitgridcell(x, grid->minX, grid->invCellW)
+	) * grid->wordsPerCell;
+	hitCount = 0;
+
+	/* Only drawables in the cell are tested */
+	for (i = 0; i < grid->wordsPerCell; i++)
+	{
+		unsigned int word = cellBits[i];
+
+		for (j = 0; word != 0; j++, word >>= 1)
+		{
+			int index = i * 32 + j;
+
+			if (
+				(word & 1) && index < drawCount &&
+				(drawDynFlags[index] & csmIsVisible) && drawOpacity[index] > 0.0f &&
+				l2dh_drawablehit(model, index, x, y, drawVertex[index], drawIndex[index], drawIndexCount[index])
+			)
+			{
+				/* Insertion sort, topmost (highest render order) first */
+				int k = hitCount++;
+				for (; k > 0 && drawRenderOrder[model->drawableScratch[k - 1]] < drawRenderOrder[index]; k--)
+					model->drawableScratch[k] = model->drawableScratch[k - 1];
+				model->drawableScratch[k] = index;
+			}
+		}
+	}
+
+	/* Result is always array */
+	if (lua_istable(L, 4))
+	{
+		tableIndex = 4;
+		namedRet = l2dh_istrue(L, 5);
+	}
+	else
+	{
+		namedRet = l2dh_istrue(L, 4);
+		lua_createtable(L, hitCount, 0);
+		tableIndex = lua_gettop(L);
+		PROFILE_ADD(profile, tables, 1);
+	}
+
+	oldLen = (int) lua_objlen(L, tableIndex);
+
+	for (i = 0; i < hitCount; i++)
+	{
+		if (namedRet)
+			lua_pushstring(L, drawNames[model->drawableScratch[i]]);
+		else
+			lua_pushinteger(L, model->drawableScratch[i] + 1);
+		lua_rawseti(L, tableIndex, i + 1);
+	}
+
+	/* Clear leftover from user-supplied table */
+	for (i = hitCount + 1; i <= oldLen; i++)
+	{
+		lua_pushnil(L);
+		lua_rawseti(L, tableIndex, i);
+	}
+
+	lua_pushvalue(L, tableIndex);
+	PROFILE_ADD(profile, strings, namedRet ? hitCount : 0);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_HITTESTALL);
+	return 1;
+}
+
+static int l2dw_getBounds(lua_State *L)
+{
+	ModelDefinition *model;
+	const float *bounds;
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+
+	if (lua_isnoneornil(L, 2))
+		bounds = model->modelBounds;
+	else
+	{
+		int index;
+
+		if (lua_type(L, 2) == LUA_TSTRING)
+			index = l2dh_finddrawable(L, model, 2);
+		else
+			index = luaL_checkint(L, 2) - 1;
+
+		if (index < 0 || index >= csmGetDrawableCount(model->model))
+			luaL_argerror(L, 2, "invalid drawable");
+
+		bounds = model->drawableBounds + index * 4;
+	}
+
+	lua_pushnumber(L, bounds[0]);
+	lua_pushnumber(L, bounds[1]);
+	lua_pushnumber(L, bounds[2]);
+	lua_pushnumber(L, bounds[3]);
+	return 4;
+}
+
+static int l2dw_cull(lua_State *L)
+{
+	ModelDefinition *model;
+	int drawCount, namedRet, tableIndex, visibleCount, oldLen, i;
+	float viewRect[4], transform[6];
+	const char **drawNames;
+	const int *drawRenderOrder, *drawVertexCount;
+	const csmFlags *drawDynFlags;
+	const float *drawOpacity;
+
+	PROFILE_BEGIN(profile);
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	l2dh_checkrect(L, 2, viewRect);
+	l2dh_opttransform(L, 3, transform);
+	drawCount = csmGetDrawableCount(model->model);
+	drawNames = csmGetDrawableIds(model->model);
+	drawRenderOrder = csmGetDrawableRenderOrders(model->model);
+	drawVertexCount = csmGetDrawableVertexCounts(model->model);
+	drawDynFlags = csmGetDrawableDynamicFlags(model->model);
+	drawOpacity = csmGetDrawableOpacities(model->model);
+
+	/* Scratch is indexed by render order so result is in render order */
+	for (i = 0; i < drawCount; i++)
+		model->drawableScratch[i] = -1;
+
+	for (i = 0; i < drawCount; i++)
+	{
+		float bounds[4];
+
+		if (
+			!(drawDynFlags[i] & csmIsVisible) || drawOpacity[i] <= 0.0f || drawVertexCount[i] == 0 ||
+			drawRenderOrder[i] < 0 || drawRenderOrder[i] >= drawCount
+		)
+			continue;
+
+		l2dh_transformbounds(transform, model->drawableBounds + i * 4, bounds);
+		if (bounds[0] <= viewRect[2] && bounds[2] >= viewRect[0] && bounds[1] <= viewRect[3] && bounds[3] >= viewRect[1])
+			model->drawableScratch[drawRenderOrder[i]] = i;
+	}
+
+	/* Result is always array */
+	if (lua_istable(L, 4))
+	{
+		tableIndex = 4;
+		namedRet = l2dh_istrue(L, 5);
+	}
+	else
+	{
+		namedRet = l2dh_istrue(L, 4);
+		lua_createtable(L, drawCount, 0);
+		tableIndex = lua_gettop(L);
+		PROFILE_ADD(profile, tables, 1);
+	}
+
+	oldLen = (int) lua_objlen(L, tableIndex);
+	visibleCount = 0;
+
+	for (i = 0; i < drawCount; i++)
+	{
+		int index = model->drawableScratch[i];
+
+		if (index >= 0)
+		{
+			if (namedRet)
+				lua_pushstring(L, drawNames[index]);
+			else
+				lua_pushinteger(L, index + 1);
+			lua_rawseti(L, tableIndex, ++visibleCount);
+		}
+	}
+
+	/* Clear leftover from user-supplied table */
+	for (i = visibleCount + 1; i <= oldLen; i++)
+	{
+		lua_pushnil(L);
+		lua_rawseti(L, tableIndex, i);
+	}
+
+	lua_pushvalue(L, tableIndex);
+	PROFILE_ADD(profile, strings, namedRet ? visibleCount : 0);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_CULL);
+	return 1;
+}
+
+static int l2dw_snapshot(lua_State *L)
+{
+	ModelDefinition *model;
+	ModelSnapshot *snap = NULL;
+	int paramCount, partCount;
+
+	PROFILE_BEGIN(profile);
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	paramCount = csmGetParameterCount(model->model);
+	partCount = csmGetPartCount(model->model);
+
+	/* Reuse user-supplied snapshot if it's compatible */
+	if (!lua_isnoneornil(L, 2))
+	{
+		snap = (ModelSnapshot *) luaL_checkudata(L, 2, LUALIVE2D_SNAPSHOT_METATABLE_NAME);
+		if (snap->paramCount != paramCount || snap->partCount != partCount)
+			snap = NULL;
+		else
+			lua_pushvalue(L, 2);
+	}
+
+	if (snap == NULL)
+	{
+		snap = (ModelSnapshot *) lua_newuserdata(L, sizeof(ModelSnapshot) + sizeof(float) * (paramCount + partCount));
+		snap->paramCount = paramCount;
+		snap->partCount = partCount;
+		luaL_getmetatable(L, LUALIVE2D_SNAPSHOT_METATABLE_NAME);
+		lua_setmetatable(L, -2);
+	}
+
+	memcpy(snap->values, csmGetParameterValues(model->model), sizeof(float) * paramCount);
+	memcpy(snap->values + paramCount, csmGetPartOpacities(model->model), sizeof(float) * partCount);
+
+	PROFILE_ADD(profile, bytes, sizeof(float) * (paramCount + partCount));
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_SNAPSHOT);
+	return 1;
+}
+
+static int l2dw_restore(lua_State *L)
+{
+	ModelDefinition *model;
+	ModelSnapshot *snap;
+
+	PROFILE_BEGIN(profile);
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	snap = (ModelSnapshot *) luaL_checkudata(L, 2, LUALIVE2D_SNAPSHOT_METATABLE_NAME);
+
+	if (snap->paramCount != csmGetParameterCount(model->model) || snap->partCount != csmGetPartCount(model->model))
+		luaL_argerror(L, 2, "snapshot is not taken from compatible model");
+
+	memcpy(csmGetParameterValues(model->model), snap->values, sizeof(float) * snap->paramCount);
+	memcpy(csmGetPartOpacities(model->model), snap->values + snap->paramCount, sizeof(float) * snap->partCount);
+
+	/* Scheduled model must not interpolate from the pose before restore */
+	if (model->lod)
+		l2dh_lodreset(model);
+
+	PROFILE_ADD(profile, bytes, sizeof(float) * (snap->paramCount + snap->partCount));
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_RESTORE);
 	return 0;
 }
 
 /* Libraries to export */
 const luaL_Reg l2d_export[] = {
 	{"loadModelFromString", &l2d_loadModel},
+	{"newScheduler", &l2d_newScheduler},
 	{NULL, NULL}
 };
 
@@ -738,8 +1840,25 @@ const luaL_Reg l2dw_export[] = {
 	{"getPartsData", &l2dw_getPartsData},
 	{"getPartsOpacity", &l2dw_getPartsOpacity},
 	{"getDrawableData", &l2dw_getDrawableData},
+	{"getStaticMeshData", &l2dw_getStaticMeshData},
 	{"getDynamicDrawableData", &l2dw_getDynamicDrawableData},
 	{"resetDynamicDrawableFlags", &l2dw_resetDynamicDrawableFlags},
+	{"hitTest", &l2dw_hitTest},
+	{"hitTestAll", &l2dw_hitTestAll},
+	{"getBounds", &l2dw_getBounds},
+	{"cull", &l2dw_cull},
+	{"renderToBuffer", &l2dw_renderToBuffer},
+	{"newRecorder", &l2dw_newRecorder},
+	{"newPlayer", &l2dw_newPlayer},
+	{"snapshot", &l2dw_snapshot},
+	{"restore", &l2dw_restore},
+	{"getStats", &l2dw_getStats},
+	{"resetStats", &l2dw_resetStats},
+	{NULL, NULL}
+};
+
+/* Snapshot methods to export */
+const luaL_Reg l2ds_export[] = {
 	{NULL, NULL}
 };
 
@@ -762,21 +1881,35 @@ int EXPORT_SIGNATURE luaopen_lualive2d_core(lua_State *L)
 	lua_createtable(L, 0, sizeof(l2d_export) + 2);
 
 	lua_pushlstring(L, "_mt", 3);
-	/* Create new metatable */
-	luaL_newmetatable(L, LUALIVE2D_METATABLE_NAME);
-	lua_pushlstring(L, "__index", 7);
-	lua_newtable(L);
-	/* Export methods */
-	for (i = l2dw_export; i->name != NULL; i++)
+	/* Create new metatable. __gc and __tostring must be in the metatable */
+	/* itself, otherwise the model memory is never freed. */
+	l2dh_newmetatable(L, LUALIVE2D_METATABLE_NAME, l2dw_export);
+	luaL_getmetatable(L, LUALIVE2D_METATABLE_NAME);
+	/* set metatable to global module table */
+	lua_rawset(L, -3);
+	/* Recorder and player metatables */
+	l2d_openrecorder(L);
+	/* Scheduler metatable */
+	l2d_openscheduler(L);
+	/* Render output metatable */
+	l2d_openrender(L);
+	/* Snapshot metatable */
+	l2dh_newmetatable(L, LUALIVE2D_SNAPSHOT_METATABLE_NAME, l2ds_export);
+	/* Static mesh data cache, entries are collected when no model uses them */
+	lua_getfield(L, LUA_REGISTRYINDEX, LUALIVE2D_STATICMESH_CACHE_NAME);
+	if (lua_isnil(L, -1))
 	{
-		lua_pushstring(L, i->name);
-		lua_pushcfunction(L, i->func);
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushlstring(L, "__mode", 6);
+		lua_pushlstring(L, "v", 1);
 		lua_rawset(L, -3);
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUALIVE2D_STATICMESH_CACHE_NAME);
 	}
-	/* Set __index to metatable */
-	lua_rawset(L, -3);
-	/* set metatable to global module table */
-	lua_rawset(L, -3);
+	else
+		lua_pop(L, 1);
 
 	/* Export methods */
 	for (i = l2d_export; i->name != NULL; i++)
@@ -785,6 +1918,13 @@ int EXPORT_SIGNATURE luaopen_lualive2d_core(lua_State *L)
 		lua_pushcfunction(L, i->func);
 		lua_rawset(L, -3);
 	}
+	/* Profiling functions */
+	for (i = l2dprof_export; i->name != NULL; i++)
+	{
+		lua_pushstring(L, i->name);
+		lua_pushcfunction(L, i->func);
+		lua_rawset(L, -3);
+	}
 
 	/* Live2D core function pointer, for LuaJIT FFI */
 	/* Pointer is stored as sizeof(void*)-sized string */
@@ -0,0 +1,343 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Hot-path instrumentation. Counters are kept globally and per model, and */
+/* each call can optionally be recorded as Chrome trace event. */
+
+/* std */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Lua */
+#include "lua.h"
+#include "lauxlib.h"
+
+/* lua-live2d */
+#include "lualive2d.h"
+
+#ifdef LUALIVE2D_PROFILE
+
+/* Maximum amount of trace events kept, the rest are dropped */
+#define PROFILE_MAX_TRACE_EVENTS (1 << 20)
+
+typedef struct ProfileTraceEvent
+{
+	const void *model;
+	unsigned long long start, duration;
+	unsigned int vertices, bytes, tables;
+	int id;
+} ProfileTraceEvent;
+
+/* Must match LUALIVE2D_PROFILE_* order */
+static const char *profileNames[LUALIVE2D_PROFILE_COUNT] = {
+	"loadModelFromString",
+	"update",
+	"csmUpdateModel",
+	"getParameterDefault",
+	"getParameterValues",
+	"setParameterValues",
+	"getPartsData",
+	"getPartsOpacity",
+	"getDrawableData",
+	"getDynamicDrawableData",
+	"resetDynamicDrawableFlags",
+	"hitTest",
+	"hitTestAll",
+	"cull",
+	"renderToBuffer",
+	"snapshot",
+	"restore",
+	"step",
+	"getStaticMeshData"
+};
+
+int l2dprof_enabled = 0;
+static int profileTrace = 0;
+static unsigned long long profileEpoch = 0;
+static ProfileCounter profileGlobal[LUALIVE2D_PROFILE_COUNT];
+static ProfileTraceEvent *profileEvents = NULL;
+static size_t profileEventCount = 0, profileEventCapacity = 0, profileEventDropped = 0;
+
+/* Monotonic time in nanoseconds */
+static unsigned long long l2dprof_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+	return (unsigned long long) (counter.QuadPart / frequency.QuadPart) * 1000000000ULL +
+		(unsigned long long) (counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+#endif
+}
+
+/* Only called when profiling is enabled */
+unsigned long long l2dprof_begin(void)
+{
+	return l2dprof_now();
+}
+
+static void l2dprof_add(ProfileCounter *counter, unsigned long long duration, const ProfileScope *scope)
+{
+	counter->calls++;
+	counter->time += duration;
+	counter->vertices += scope->vertices;
+	counter->bytes += scope->bytes;
+	counter->tables += scope->tables;
+	counter->strings += scope->strings;
+}
+
+void l2dprof_end(ModelDefinition *model, int id, const ProfileScope *scope)
+{
+	unsigned long long duration;
+
+	/* Profiling was not enabled when the scope started */
+	if (scope->start == 0 || !l2dprof_enabled)
+		return;
+
+	duration = l2dprof_now() - scope->start;
+	l2dprof_add(profileGlobal + id, duration, scope);
+	if (model)
+		l2dprof_add(model->profile + id, duration, scope);
+
+	if (profileTrace)
+	{
+		ProfileTraceEvent *ev;
+
+		if (profileEventCount == profileEventCapacity)
+		{
+			size_t newCapacity = profileEventCapacity ? profileEventCapacity * 2 : 4096;
+			ProfileTraceEvent *newEvents = NULL;
+
+			if (newCapacity <= PROFILE_MAX_TRACE_EVENTS)
+				newEvents = (ProfileTraceEvent *) realloc(profileEvents, sizeof(ProfileTraceEvent) * newCapacity);
+
+			if (newEvents == NULL)
+			{
+				profileEventDropped++;
+				return;
+			}
+
+			profileEvents = newEvents;
+			profileEventCapacity = newCapacity;
+		}
+
+		ev = profileEvents + profileEventCount++;
+		ev->model = model;
+		ev->start = scope->start;
+		ev->duration = duration;
+		ev->vertices = scope->vertices;
+		ev->bytes = scope->bytes;
+		ev->tables = scope->tables;
+		ev->id = id;
+	}
+}
+
+static void l2dprof_pushcounters(lua_State *L, const ProfileCounter *counters)
+{
+	lua_createtable(L, 0, LUALIVE2D_PROFILE_COUNT);
+
+	for (int i = 0; i < LUALIVE2D_PROFILE_COUNT; i++)
+	{
+		const ProfileCounter *c = counters + i;
+
+		if (c->calls == 0)
+			continue;
+
+		lua_pushstring(L, profileNames[i]);
+		lua_createtable(L, 0, 6);
+		lua_pushlstring(L, "calls", 5);
+		lua_pushnumber(L, (lua_Number) c->calls);
+		lua_rawset(L, -3);
+		/* Seconds */
+		lua_pushlstring(L, "time", 4);
+		lua_pushnumber(L, (lua_Number) c->time / 1e9);
+		lua_rawset(L, -3);
+		lua_pushlstring(L, "vertices", 8);
+		lua_pushnumber(L, (lua_Number) c->vertices);
+		lua_rawset(L, -3);
+		lua_pushlstring(L, "bytes", 5);
+		lua_pushnumber(L, (lua_Number) c->bytes);
+		lua_rawset(L, -3);
+		/* Estimated, see ProfileCounter */
+		lua_pushlstring(L, "tables", 6);
+		lua_pushnumber(L, (lua_Number) c->tables);
+		lua_rawset(L, -3);
+		lua_pushlstring(L, "strings", 7);
+		lua_pushnumber(L, (lua_Number) c->strings);
+		lua_rawset(L, -3);
+		lua_rawset(L, -3);
+	}
+}
+
+static int l2dprof_setProfiling(lua_State *L)
+{
+	l2dprof_enabled = lua_toboolean(L, 1);
+	profileTrace = l2dprof_enabled && lua_toboolean(L, 2);
+
+	if (profileEpoch == 0)
+		profileEpoch = l2dprof_now();
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int l2dprof_getStats(lua_State *L)
+{
+	l2dprof_pushcounters(L, profileGlobal);
+	return 1;
+}
+
+static int l2dprof_resetStats(lua_State *L)
+{
+	(void) L;
+	memset(profileGlobal, 0, sizeof(profileGlobal));
+	profileEventCount = 0;
+	profileEventDropped = 0;
+	profileEpoch = l2dprof_now();
+	return 0;
+}
+
+/* Write recorded events as Chrome trace event JSON (chrome://tracing, Perfetto) */
+static int l2dprof_dumpTrace(lua_State *L)
+{
+	const char *filename = luaL_checkstring(L, 1);
+	FILE *f = fopen(filename, "w");
+
+	if (f == NULL)
+	{
+		lua_pushnil(L);
+		lua_pushfstring(L, "cannot open %s", filename);
+		return 2;
+	}
+
+	fputs("{\"traceEvents\":[", f);
+
+	for (size_t i = 0; i < profileEventCount; i++)
+	{
+		const ProfileTraceEvent *ev = profileEvents + i;
+		unsigned long long start = ev->start > profileEpoch ? ev->start - profileEpoch : 0;
+
+		fprintf(f,
+			"%s\n{\"name\":\"%s\",\"cat\":\"lualive2d\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"model\":\"%p\",\"vertices\":%u,\"bytes\":%u,\"tables\":%u}}",
+			i == 0 ? "" : ",",
+			profileNames[ev->id],
+			start / 1000.0,
+			ev->duration / 1000.0,
+			ev->model,
+			ev->vertices,
+			ev->bytes,
+			ev->tables
+		);
+	}
+
+	fprintf(f, "\n],\"otherData\":{\"droppedEvents\":%lu}}\n", (unsigned long) profileEventDropped);
+	fclose(f);
+
+	lua_pushnumber(L, (lua_Number) profileEventCount);
+	return 1;
+}
+
+int l2dw_getStats(lua_State *L)
+{
+	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	l2dprof_pushcounters(L, model->profile);
+	return 1;
+}
+
+int l2dw_resetStats(lua_State *L)
+{
+	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	memset(model->profile, 0, sizeof(model->profile));
+	return 0;
+}
+
+#else
+
+/* Instrumentation is not compiled in */
+
+static int l2dprof_setProfiling(lua_State *L)
+{
+	lua_pushboolean(L, 0);
+	return 1;
+}
+
+static int l2dprof_getStats(lua_State *L)
+{
+	lua_newtable(L);
+	return 1;
+}
+
+static int l2dprof_resetStats(lua_State *L)
+{
+	(void) L;
+	return 0;
+}
+
+static int l2dprof_dumpTrace(lua_State *L)
+{
+	lua_pushnil(L);
+	lua_pushstring(L, "profiling is not compiled in");
+	return 2;
+}
+
+int l2dw_getStats(lua_State *L)
+{
+	luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	lua_newtable(L);
+	return 1;
+}
+
+int l2dw_resetStats(lua_State *L)
+{
+	luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	return 0;
+}
+
+#endif
+
+/* Module functions to export */
+const luaL_Reg l2dprof_export[] = {
+	{"setProfiling", &l2dprof_setProfiling},
+	{"getStats", &l2dprof_getStats},
+	{"resetStats", &l2dprof_resetStats},
+	{"dumpTrace", &l2dprof_dumpTrace},
+	{NULL, NULL}
+};
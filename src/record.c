@@ -0,0 +1,784 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Parameter frame recorder and replayer. */
+/* Stream format, all little-endian: */
+/* Header: "L2DR", u8 version, u8 bits, u16 keyframe interval, u32 parameter count, */
+/*         u32 part count, f32 parameter minimum[parameter count], */
+/*         f32 parameter maximum[parameter count] */
+/* Frame:  u8 type, varint payload size, payload */
+/* Keyframe payload holds every quantized value (bits / 8 bytes each). Delta frame */
+/* payload holds zigzag varint difference from the previous frame quantized values. */
+/* Parameters are quantized against their min/max, part opacities against 0..1. */
+/* A player can start at any keyframe if it's given the header first, so */
+/* spectators can join a live stream without the frames before it. */
+
+/* std */
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lua */
+#include "lua.h"
+#include "lauxlib.h"
+
+/* lua-live2d */
+#include "lualive2d.h"
+
+#define RECORDER_METATABLE_NAME "Live2DRecorder*"
+#define PLAYER_METATABLE_NAME "Live2DPlayer*"
+
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 16
+#define RECORD_FRAME_KEY 0
+#define RECORD_FRAME_DELTA 1
+
+typedef struct RecordBuffer
+{
+	unsigned char *data;
+	size_t size, capacity;
+} RecordBuffer;
+
+typedef struct RecordChannels
+{
+	ModelDefinition *model;
+	/* Minimum value and (max - min), per channel. Parameters first, then parts. */
+	float *min, *range;
+	/* Quantized values of the last frame */
+	unsigned short *last;
+	int paramCount, partCount, bits, keyframeInterval;
+} RecordChannels;
+
+typedef struct Recorder
+{
+	RecordChannels ch;
+	/* Bytes not yet returned by flush */
+	RecordBuffer pending;
+	/* Stream header, also written at the start of pending */
+	RecordBuffer header;
+	unsigned short *current;
+	int frameCount;
+} Recorder;
+
+typedef struct Player
+{
+	RecordChannels ch;
+	/* Whole stream */
+	RecordBuffer stream;
+	/* Offset of each complete frame in stream */
+	size_t *frameOffset;
+	size_t scanOffset;
+	int frameCount, frameCapacity, headerRead;
+	/* Index of each keyframe in frameOffset, ascending */
+	int *keyframe;
+	int keyframeCount, keyframeCapacity;
+	/* Amount of frames dropped by trim. Frame numbers seen by Lua count them. */
+	int frameBase;
+	/* Last decoded frame, 0-based. -1 if none. */
+	int position;
+} Player;
+
+static void l2dh_bufferreserve(lua_State *L, RecordBuffer *buf, size_t extra)
+{
+	if (buf->size + extra > buf->capacity)
+	{
+		size_t newCapacity = buf->capacity ? buf->capacity : 256;
+		unsigned char *newData;
+
+		while (newCapacity < buf->size + extra)
+			newCapacity *= 2;
+
+		newData = (unsigned char *) realloc(buf->data, newCapacity);
+		if (newData == NULL)
+			luaL_error(L, "cannot allocate record buffer");
+
+		buf->data = newData;
+		buf->capacity = newCapacity;
+	}
+}
+
+static void l2dh_bufferwrite(lua_State *L, RecordBuffer *buf, const void *data, size_t size)
+{
+	l2dh_bufferreserve(L, buf, size);
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+static void l2dh_writeu32(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+	p[2] = (unsigned char) (v >> 16);
+	p[3] = (unsigned char) (v >> 24);
+}
+
+static unsigned int l2dh_readu32(const unsigned char *p)
+{
+	return p[0] | ((unsigned int) p[1] << 8) | ((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static void l2dh_writef32(unsigned char *p, float v)
+{
+	unsigned int u;
+	memcpy(&u, &v, 4);
+	l2dh_writeu32(p, u);
+}
+
+static float l2dh_readf32(const unsigned char *p)
+{
+	unsigned int u = l2dh_readu32(p);
+	float v;
+	memcpy(&v, &u, 4);
+	return v;
+}
+
+/* Returns amount of bytes written, at most 5 */
+static int l2dh_writevarint(unsigned char *p, unsigned int v)
+{
+	int n = 0;
+
+	while (v >= 0x80)
+	{
+		p[n++] = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+
+	p[n++] = (unsigned char) v;
+	return n;
+}
+
+/* Returns amount of bytes read, 0 if incomplete or invalid */
+static int l2dh_readvarint(const unsigned char *p, size_t size, unsigned int *v)
+{
+	*v = 0;
+
+	for (int n = 0; n < 5 && (size_t) n < size; n++)
+	{
+		*v |= (unsigned int) (p[n] & 0x7F) << (n * 7);
+		if ((p[n] & 0x80) == 0)
+			return n + 1;
+	}
+
+	return 0;
+}
+
+static int l2dh_channelsinit(lua_State *L, RecordChannels *ch, ModelDefinition *model, int paramCount, int partCount)
+{
+	int count = paramCount + partCount;
+
+	ch->model = model;
+	ch->paramCount = paramCount;
+	ch->partCount = partCount;
+	ch->min = (float *) malloc(sizeof(float) * (count + 1));
+	ch->range = (float *) malloc(sizeof(float) * (count + 1));
+	ch->last = (unsigned short *) calloc(count + 1, sizeof(unsigned short));
+
+	if (ch->min == NULL || ch->range == NULL || ch->last == NULL)
+		return luaL_error(L, "cannot allocate record channels");
+
+	/* Part opacities */
+	for (int i = paramCount; i < count; i++)
+	{
+		ch->min[i] = 0.0f;
+		ch->range[i] = 1.0f;
+	}
+
+	return 0;
+}
+
+static void l2dh_channelsfree(RecordChannels *ch)
+{
+	free(ch->min);
+	free(ch->range);
+	free(ch->last);
+	ch->min = ch->range = NULL;
+	ch->last = NULL;
+}
+
+static unsigned short l2dh_quantize(const RecordChannels *ch, int i, float v)
+{
+	float levels = (float) ((1 << ch->bits) - 1);
+	float q;
+
+	if (ch->range[i] <= 0.0f)
+		return 0;
+
+	q = (v - ch->min[i]) / ch->range[i] * levels + 0.5f;
+	/* Also catches NaN */
+	if (!(q > 0.0f))
+		return 0;
+	else if (q >= levels)
+		return (unsigned short) levels;
+	else
+		return (unsigned short) q;
+}
+
+static float l2dh_dequantize(const RecordChannels *ch, int i, unsigned short q)
+{
+	return ch->min[i] + ch->range[i] * ((float) q / (float) ((1 << ch->bits) - 1));
+}
+
+/* Check the channels are usable and the model the recorder/player is bound to */
+/* is still compatible */
+static void l2dh_channelscheck(lua_State *L, const RecordChannels *ch)
+{
+	if (ch->min == NULL || (ch->bits != 8 && ch->bits != 16) || ch->keyframeInterval <= 0)
+		luaL_error(L, "invalid record channels");
+
+	if (
+		csmGetParameterCount(ch->model->model) != ch->paramCount ||
+		csmGetPartCount(ch->model->model) != ch->partCount
+	)
+		luaL_error(L, "model does not match the recording");
+}
+
+int l2dw_newRecorder(lua_State *L)
+{
+	ModelDefinition *model;
+	Recorder *rec;
+	int keyframeInterval, bits;
+	const float *paramMin, *paramMax;
+	unsigned char header[RECORD_HEADER_SIZE];
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	keyframeInterval = luaL_optint(L, 2, 30);
+	bits = luaL_optint(L, 3, 16);
+	luaL_argcheck(L, keyframeInterval > 0 && keyframeInterval <= 65535, 2, "invalid keyframe interval");
+	luaL_argcheck(L, bits == 8 || bits == 16, 3, "bits must be 8 or 16");
+
+	rec = (Recorder *) lua_newuserdata(L, sizeof(Recorder));
+	memset(rec, 0, sizeof(Recorder));
+	luaL_getmetatable(L, RECORDER_METATABLE_NAME);
+	lua_setmetatable(L, -2);
+
+	/* Keep the model alive */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+
+	l2dh_channelsinit(L, &rec->ch, model, csmGetParameterCount(model->model), csmGetPartCount(model->model));
+	rec->ch.bits = bits;
+	rec->ch.keyframeInterval = keyframeInterval;
+	rec->current = (unsigned short *) malloc(sizeof(unsigned short) * (rec->ch.paramCount + rec->ch.partCount + 1));
+	if (rec->current == NULL)
+		luaL_error(L, "cannot allocate record channels");
+
+	paramMin = csmGetParameterMinimumValues(model->model);
+	paramMax = csmGetParameterMaximumValues(model->model);
+
+	/* Header */
+	memcpy(header, "L2DR", 4);
+	header[4] = RECORD_VERSION;
+	header[5] = (unsigned char) bits;
+	header[6] = (unsigned char) keyframeInterval;
+	header[7] = (unsigned char) (keyframeInterval >> 8);
+	l2dh_writeu32(header + 8, (unsigned int) rec->ch.paramCount);
+	l2dh_writeu32(header + 12, (unsigned int) rec->ch.partCount);
+	l2dh_bufferwrite(L, &rec->header, header, RECORD_HEADER_SIZE);
+	l2dh_bufferreserve(L, &rec->header, rec->ch.paramCount * 8);
+
+	for (int i = 0; i < rec->ch.paramCount; i++)
+	{
+		rec->ch.min[i] = paramMin[i];
+		rec->ch.range[i] = paramMax[i] - paramMin[i];
+		l2dh_writef32(rec->header.data + rec->header.size + i * 4, paramMin[i]);
+		l2dh_writef32(rec->header.data + rec->header.size + (rec->ch.paramCount + i) * 4, paramMax[i]);
+	}
+
+	rec->header.size += rec->ch.paramCount * 8;
+	l2dh_bufferwrite(L, &rec->pending, rec->header.data, rec->header.size);
+	return 1;
+}
+
+static int l2dr___gc(lua_State *L)
+{
+	Recorder *rec = (Recorder *) luaL_checkudata(L, 1, RECORDER_METATABLE_NAME);
+
+	l2dh_channelsfree(&rec->ch);
+	free(rec->current);
+	free(rec->pending.data);
+	free(rec->header.data);
+	rec->current = NULL;
+	rec->pending.data = NULL;
+	rec->header.data = NULL;
+	return 0;
+}
+
+static int l2dr_capture(lua_State *L)
+{
+	Recorder *rec = (Recorder *) luaL_checkudata(L, 1, RECORDER_METATABLE_NAME);
+	RecordChannels *ch = &rec->ch;
+	int count = ch->paramCount + ch->partCount, key, bytesPerValue = ch->bits / 8;
+	const float *paramValues, *partOpacity;
+	unsigned char *payload, sizeBuf[5];
+	size_t payloadSize = 0;
+	int sizeLen;
+
+	l2dh_channelscheck(L, ch);
+	paramValues = csmGetParameterValues(ch->model->model);
+	partOpacity = csmGetPartOpacities(ch->model->model);
+
+	for (int i = 0; i < ch->paramCount; i++)
+		rec->current[i] = l2dh_quantize(ch, i, paramValues[i]);
+	for (int i = 0; i < ch->partCount; i++)
+		rec->current[ch->paramCount + i] = l2dh_quantize(ch, ch->paramCount + i, partOpacity[i]);
+
+	/* Worst case: 1 type byte, 5 size bytes, 3 bytes per delta */
+	key = rec->frameCount % ch->keyframeInterval == 0;
+	l2dh_bufferreserve(L, &rec->pending, 6 + (size_t) count * 3);
+	payload = rec->pending.data + rec->pending.size + 6;
+
+	if (key)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			payload[payloadSize++] = (unsigned char) rec->current[i];
+			if (bytesPerValue == 2)
+				payload[payloadSize++] = (unsigned char) (rec->current[i] >> 8);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < count; i++)
+		{
+			int delta = (int) rec->current[i] - (int) ch->last[i];
+			unsigned int zigzag = (unsigned int) ((delta << 1) ^ (delta >> 31));
+			payloadSize += l2dh_writevarint(payload + payloadSize, zigzag);
+		}
+	}
+
+	/* Frame header then move payload right after it */
+	rec->pending.data[rec->pending.size] = key ? RECORD_FRAME_KEY : RECORD_FRAME_DELTA;
+	sizeLen = l2dh_writevarint(sizeBuf, (unsigned int) payloadSize);
+	memcpy(rec->pending.data + rec->pending.size + 1, sizeBuf, sizeLen);
+	memmove(rec->pending.data + rec->pending.size + 1 + sizeLen, payload, payloadSize);
+	rec->pending.size += 1 + sizeLen + payloadSize;
+
+	memcpy(ch->last, rec->current, sizeof(unsigned short) * count);
+	rec->frameCount++;
+
+	lua_pushinteger(L, rec->frameCount);
+	lua_pushboolean(L, key);
+	return 2;
+}
+
+static int l2dr_flush(lua_State *L)
+{
+	Recorder *rec = (Recorder *) luaL_checkudata(L, 1, RECORDER_METATABLE_NAME);
+
+	lua_pushlstring(L, (const char *) rec->pending.data, rec->pending.size);
+	rec->pending.size = 0;
+	return 1;
+}
+
+static int l2dr_getFrameCount(lua_State *L)
+{
+	Recorder *rec = (Recorder *) luaL_checkudata(L, 1, RECORDER_METATABLE_NAME);
+	lua_pushinteger(L, rec->frameCount);
+	return 1;
+}
+
+/* Header alone, for players which start at a later keyframe */
+static int l2dr_getHeader(lua_State *L)
+{
+	Recorder *rec = (Recorder *) luaL_checkudata(L, 1, RECORDER_METATABLE_NAME);
+	lua_pushlstring(L, (const char *) rec->header.data, rec->header.size);
+	return 1;
+}
+
+/* Parse header and index complete frames received so far */
+static void l2dh_playerscan(lua_State *L, Player *player)
+{
+	const unsigned char *data = player->stream.data;
+	size_t size = player->stream.size;
+
+	if (!player->headerRead)
+	{
+		int paramCount, partCount, keyframeInterval, bits;
+
+		if (size < RECORD_HEADER_SIZE)
+			return;
+
+		if (memcmp(data, "L2DR", 4) != 0 || data[4] != RECORD_VERSION)
+			luaL_error(L, "invalid record stream");
+
+		bits = data[5];
+		keyframeInterval = data[6] | (data[7] << 8);
+		paramCount = (int) l2dh_readu32(data + 8);
+		partCount = (int) l2dh_readu32(data + 12);
+
+		if ((bits != 8 && bits != 16) || keyframeInterval == 0)
+			luaL_error(L, "invalid record stream");
+		if (paramCount != csmGetParameterCount(player->ch.model->model) || partCount != csmGetPartCount(player->ch.model->model))
+			luaL_error(L, "model does not match the recording");
+		if (size < RECORD_HEADER_SIZE + (size_t) paramCount * 8)
+			return;
+
+		l2dh_channelsinit(L, &player->ch, player->ch.model, paramCount, partCount);
+		player->ch.bits = bits;
+		player->ch.keyframeInterval = keyframeInterval;
+
+		for (int i = 0; i < paramCount; i++)
+		{
+			float min = l2dh_readf32(data + RECORD_HEADER_SIZE + i * 4);
+			float max = l2dh_readf32(data + RECORD_HEADER_SIZE + (paramCount + i) * 4);
+
+			/* Also catches NaN and infinity */
+			if (!(max - min >= 0.0f && max - min <= FLT_MAX))
+				luaL_error(L, "invalid record stream");
+
+			player->ch.min[i] = min;
+			player->ch.range[i] = max - min;
+		}
+
+		player->scanOffset = RECORD_HEADER_SIZE + (size_t) paramCount * 8;
+		player->headerRead = 1;
+	}
+
+	while (player->scanOffset < size)
+	{
+		unsigned int payloadSize;
+		int type = data[player->scanOffset];
+		int sizeLen = l2dh_readvarint(data + player->scanOffset + 1, size - player->scanOffset - 1, &payloadSize);
+
+		if (type != RECORD_FRAME_KEY && type != RECORD_FRAME_DELTA)
+			luaL_error(L, "invalid frame %d", player->frameBase + player->frameCount + 1);
+
+		/* Incomplete frame */
+		if (sizeLen == 0 || player->scanOffset + 1 + sizeLen + payloadSize > size)
+		{
+			if (size - player->scanOffset > 6 && sizeLen == 0)
+				luaL_error(L, "invalid record stream");
+			break;
+		}
+
+		if (player->frameCount == player->frameCapacity)
+		{
+			int newCapacity = player->frameCapacity ? player->frameCapacity * 2 : 256;
+			size_t *newOffset = (size_t *) realloc(player->frameOffset, sizeof(size_t) * newCapacity);
+
+			if (newOffset == NULL)
+				luaL_error(L, "cannot allocate frame index");
+
+			player->frameOffset = newOffset;
+			player->frameCapacity = newCapacity;
+		}
+
+		if (type == RECORD_FRAME_KEY)
+		{
+			if (player->keyframeCount == player->keyframeCapacity)
+			{
+				int newCapacity = player->keyframeCapacity ? player->keyframeCapacity * 2 : 16;
+				int *newKeyframe = (int *) realloc(player->keyframe, sizeof(int) * newCapacity);
+
+				if (newKeyframe == NULL)
+					luaL_error(L, "cannot allocate frame index");
+
+				player->keyframe = newKeyframe;
+				player->keyframeCapacity = newCapacity;
+			}
+
+			player->keyframe[player->keyframeCount++] = player->frameCount;
+		}
+
+		player->frameOffset[player->frameCount++] = player->scanOffset;
+		player->scanOffset += 1 + sizeLen + payloadSize;
+	}
+}
+
+/* Decode frame into channel last values */
+static void l2dh_playerdecode(lua_State *L, Player *player, int frame)
+{
+	RecordChannels *ch = &player->ch;
+	const unsigned char *p = player->stream.data + player->frameOffset[frame];
+	const unsigned char *end = player->stream.data + (frame + 1 < player->frameCount ? player->frameOffset[frame + 1] : player->scanOffset);
+	int count = ch->paramCount + ch->partCount, type = *p++;
+	unsigned int payloadSize;
+
+	p += l2dh_readvarint(p, end - p, &payloadSize);
+	/* Frame boundaries were checked by l2dh_playerscan */
+	end = p + payloadSize;
+
+	if (type == RECORD_FRAME_KEY)
+	{
+		if (payloadSize != (unsigned int) count * (ch->bits / 8))
+			luaL_error(L, "invalid keyframe %d", player->frameBase + frame + 1);
+
+		for (int i = 0; i < count; i++)
+		{
+			if (ch->bits == 16)
+			{
+				ch->last[i] = (unsigned short) (p[0] | (p[1] << 8));
+				p += 2;
+			}
+			else
+				ch->last[i] = *p++;
+		}
+	}
+	else if (type == RECORD_FRAME_DELTA)
+	{
+		/* Values are updated in place. If the frame is rejected midway, make */
+		/* the next seek start over from a keyframe. */
+		player->position = -1;
+
+		for (int i = 0; i < count; i++)
+		{
+			unsigned int zigzag;
+			int len = l2dh_readvarint(p, end - p, &zigzag);
+
+			if (len == 0)
+				luaL_error(L, "invalid frame %d", player->frameBase + frame + 1);
+
+			p += len;
+			ch->last[i] = (unsigned short) (ch->last[i] + (int) ((zigzag >> 1) ^ (0U - (zigzag & 1))));
+		}
+
+		/* Payload must hold exactly one delta per channel */
+		if (p != end)
+			luaL_error(L, "invalid frame %d", player->frameBase + frame + 1);
+	}
+	else
+		luaL_error(L, "invalid frame %d", player->frameBase + frame + 1);
+
+	player->position = frame;
+}
+
+/* Write last decoded values to the model */
+static void l2dh_playerapply(Player *player)
+{
+	RecordChannels *ch = &player->ch;
+	float *paramValues = csmGetParameterValues(ch->model->model);
+	float *partOpacity = csmGetPartOpacities(ch->model->model);
+
+	for (int i = 0; i < ch->paramCount; i++)
+		paramValues[i] = l2dh_dequantize(ch, i, ch->last[i]);
+	for (int i = 0; i < ch->partCount; i++)
+		partOpacity[i] = l2dh_dequantize(ch, ch->paramCount + i, ch->last[ch->paramCount + i]);
+}
+
+static int l2dp_feed(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+
+	l2dh_bufferwrite(L, &player->stream, data, size);
+	l2dh_playerscan(L, player);
+
+	lua_pushinteger(L, player->frameCount);
+	return 1;
+}
+
+int l2dw_newPlayer(lua_State *L)
+{
+	ModelDefinition *model;
+	Player *player;
+	const char *data = NULL;
+	size_t size = 0;
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	if (!lua_isnoneornil(L, 2))
+		data = luaL_checklstring(L, 2, &size);
+
+	player = (Player *) lua_newuserdata(L, sizeof(Player));
+	memset(player, 0, sizeof(Player));
+	player->ch.model = model;
+	player->position = -1;
+	luaL_getmetatable(L, PLAYER_METATABLE_NAME);
+	lua_setmetatable(L, -2);
+
+	/* Keep the model alive */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+
+	if (data)
+	{
+		l2dh_bufferwrite(L, &player->stream, data, size);
+		l2dh_playerscan(L, player);
+	}
+
+	return 1;
+}
+
+static int l2dp___gc(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+
+	l2dh_channelsfree(&player->ch);
+	free(player->stream.data);
+	free(player->frameOffset);
+	free(player->keyframe);
+	player->stream.data = NULL;
+	player->frameOffset = NULL;
+	player->keyframe = NULL;
+	return 0;
+}
+
+/* Index in player->keyframe of the last keyframe at or before frame, -1 if none */
+static int l2dh_playerkeyframe(const Player *player, int frame)
+{
+	int lo = 0, hi = player->keyframeCount - 1, result = -1;
+
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (player->keyframe[mid] <= frame)
+		{
+			result = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	return result;
+}
+
+static int l2dp_seek(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+	int frame = luaL_checkint(L, 2) - 1 - player->frameBase, key, start;
+
+	luaL_argcheck(L, frame >= 0 && frame < player->frameCount, 2, "frame out of range");
+	l2dh_channelscheck(L, &player->ch);
+
+	/* Streams joined midway may start with delta frames */
+	key = l2dh_playerkeyframe(player, frame);
+	if (key < 0)
+		return luaL_error(L, "no keyframe at or before frame %d", player->frameBase + frame + 1);
+
+	/* Continue from the current position if it's closer than the keyframe */
+	start = player->keyframe[key];
+	if (player->position >= start && player->position <= frame)
+		start = player->position + 1;
+
+	for (int i = start; i <= frame; i++)
+		l2dh_playerdecode(L, player, i);
+
+	l2dh_playerapply(player);
+	return 0;
+}
+
+static int l2dp_nextFrame(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+
+	if (player->position + 1 >= player->frameCount)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	l2dh_channelscheck(L, &player->ch);
+
+	/* Nothing decoded yet, first frame must be keyframe */
+	if (player->position < 0 && (player->keyframeCount == 0 || player->keyframe[0] != 0))
+		return luaL_error(L, "no keyframe at or before frame %d", player->frameBase + 1);
+
+	l2dh_playerdecode(L, player, player->position + 1);
+	l2dh_playerapply(player);
+
+	lua_pushinteger(L, player->frameBase + player->position + 1);
+	return 1;
+}
+
+static int l2dp_tell(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+	lua_pushinteger(L, player->position >= 0 ? player->frameBase + player->position + 1 : 0);
+	return 1;
+}
+
+static int l2dp_getFrameCount(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+	lua_pushinteger(L, player->frameBase + player->frameCount);
+	return 1;
+}
+
+/* Drop frames before the last keyframe which is at or before the current */
+/* position, so long streams don't keep growing. Returns amount of frames dropped. */
+static int l2dp_trim(lua_State *L)
+{
+	Player *player = (Player *) luaL_checkudata(L, 1, PLAYER_METATABLE_NAME);
+	int key = player->position >= 0 ? l2dh_playerkeyframe(player, player->position) : -1;
+	int drop;
+	size_t dropSize;
+
+	if (key < 0 || player->keyframe[key] == 0)
+	{
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	/* Header was already read, it's dropped too */
+	drop = player->keyframe[key];
+	dropSize = player->frameOffset[drop];
+	memmove(player->stream.data, player->stream.data + dropSize, player->stream.size - dropSize);
+	player->stream.size -= dropSize;
+	player->scanOffset -= dropSize;
+
+	for (int i = drop; i < player->frameCount; i++)
+		player->frameOffset[i - drop] = player->frameOffset[i] - dropSize;
+	for (int i = key; i < player->keyframeCount; i++)
+		player->keyframe[i - key] = player->keyframe[i] - drop;
+
+	player->frameCount -= drop;
+	player->keyframeCount -= key;
+	player->position -= drop;
+	player->frameBase += drop;
+
+	lua_pushinteger(L, drop);
+	return 1;
+}
+
+/* Recorder methods to export */
+static const luaL_Reg l2dr_export[] = {
+	{"__gc", &l2dr___gc},
+	{"capture", &l2dr_capture},
+	{"flush", &l2dr_flush},
+	{"getFrameCount", &l2dr_getFrameCount},
+	{"getHeader", &l2dr_getHeader},
+	{NULL, NULL}
+};
+
+/* Player methods to export */
+static const luaL_Reg l2dp_export[] = {
+	{"__gc", &l2dp___gc},
+	{"feed", &l2dp_feed},
+	{"seek", &l2dp_seek},
+	{"nextFrame", &l2dp_nextFrame},
+	{"tell", &l2dp_tell},
+	{"getFrameCount", &l2dp_getFrameCount},
+	{"trim", &l2dp_trim},
+	{NULL, NULL}
+};
+
+void l2d_openrecorder(lua_State *L)
+{
+	l2dh_newmetatable(L, RECORDER_METATABLE_NAME, l2dr_export);
+	l2dh_newmetatable(L, PLAYER_METATABLE_NAME, l2dp_export);
+}
@@ -0,0 +1,1042 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Headless CPU rasterizer. */
+/* The target is split into tiles which are rendered by worker threads, so */
+/* each thread owns its part of the output and no synchronization is needed. */
+/* Worker threads are started once and kept in a pool for the next renders. */
+/* Span interior is walked one pixel at a time on purpose. Dense meshes give */
+/* spans of 1 or 2 pixels, where 4-wide SIMD was measured slower than scalar. */
+
+/* std */
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Threads */
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Lua */
+#include "lua.h"
+#include "lauxlib.h"
+
+/* lua-live2d */
+#include "lualive2d.h"
+
+/* Tile size in pixels, in each axis */
+#define RENDER_TILE_SIZE 64
+/* Maximum amount of worker threads */
+#define RENDER_MAX_THREADS 64
+/* Maximum render target width or height */
+#define RENDER_MAX_SIZE 16384
+
+#define PIXELBUFFER_METATABLE_NAME "Live2DPixelBuffer*"
+#define RENDERPOOL_METATABLE_NAME "Live2DRenderPool*"
+/* Registry field of the worker pool */
+#define RENDERPOOL_NAME "Live2DRenderPool"
+
+/* 4-component float vector, used for premultiplied RGBA */
+#ifdef LUALIVE2D_SSE2
+typedef __m128 vec4;
+
+#define vec4_set1(x) _mm_set1_ps(x)
+#define vec4_add(a, b) _mm_add_ps(a, b)
+#define vec4_sub(a, b) _mm_sub_ps(a, b)
+#define vec4_mul(a, b) _mm_mul_ps(a, b)
+#define vec4_load(p) _mm_loadu_ps(p)
+#define vec4_store(p, v) _mm_storeu_ps(p, v)
+#define vec4_alpha(v) _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))
+#define vec4_geta(v) _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)))
+
+/* Returns "a" for RGB and "b" for alpha */
+static vec4 vec4_rgbalpha(vec4 a, vec4 b)
+{
+	const __m128 rgbMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	return _mm_or_ps(_mm_and_ps(rgbMask, a), _mm_andnot_ps(rgbMask, b));
+}
+
+/* Load RGBA8 pixel as 0..255 float */
+static vec4 vec4_loadrgba8(const unsigned char *p)
+{
+	int pixel;
+	__m128i zero = _mm_setzero_si128(), v;
+
+	memcpy(&pixel, p, 4);
+	v = _mm_cvtsi32_si128(pixel);
+	v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+	return _mm_cvtepi32_ps(v);
+}
+
+/* Store 0..1 float as RGBA8 pixel */
+static void vec4_storergba8(unsigned char *p, vec4 v)
+{
+	int pixel;
+	__m128i i;
+
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	i = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+	i = _mm_packs_epi32(i, i);
+	i = _mm_packus_epi16(i, i);
+	pixel = _mm_cvtsi128_si32(i);
+	memcpy(p, &pixel, 4);
+}
+#else
+typedef struct vec4
+{
+	float v[4];
+} vec4;
+
+static vec4 vec4_set1(float x)
+{
+	vec4 r = {{x, x, x, x}};
+	return r;
+}
+
+static vec4 vec4_add(vec4 a, vec4 b)
+{
+	for (int i = 0; i < 4; i++)
+		a.v[i] += b.v[i];
+	return a;
+}
+
+static vec4 vec4_sub(vec4 a, vec4 b)
+{
+	for (int i = 0; i < 4; i++)
+		a.v[i] -= b.v[i];
+	return a;
+}
+
+static vec4 vec4_mul(vec4 a, vec4 b)
+{
+	for (int i = 0; i < 4; i++)
+		a.v[i] *= b.v[i];
+	return a;
+}
+
+static vec4 vec4_load(const float *p)
+{
+	vec4 r;
+	memcpy(r.v, p, sizeof(float) * 4);
+	return r;
+}
+
+static void vec4_store(float *p, vec4 v)
+{
+	memcpy(p, v.v, sizeof(float) * 4);
+}
+
+static vec4 vec4_alpha(vec4 v)
+{
+	return vec4_set1(v.v[3]);
+}
+
+static float vec4_geta(vec4 v)
+{
+	return v.v[3];
+}
+
+static vec4 vec4_rgbalpha(vec4 a, vec4 b)
+{
+	a.v[3] = b.v[3];
+	return a;
+}
+
+static vec4 vec4_loadrgba8(const unsigned char *p)
+{
+	vec4 r = {{p[0], p[1], p[2], p[3]}};
+	return r;
+}
+
+static void vec4_storergba8(unsigned char *p, vec4 v)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		float x = v.v[i] < 0.0f ? 0.0f : (v.v[i] > 1.0f ? 1.0f : v.v[i]);
+		p[i] = (unsigned char) (x * 255.0f + 0.5f);
+	}
+}
+#endif
+
+/* Render output. Pixels are rendered in place so frames are never copied. */
+typedef struct PixelBuffer
+{
+	int width, height;
+	/* Premultiplied RGBA8, top row first */
+	unsigned char data[];
+} PixelBuffer;
+
+typedef struct RenderTexture
+{
+	/* Premultiplied RGBA8, top row first */
+	const unsigned char *data;
+	int width, height;
+} RenderTexture;
+
+typedef struct RenderDrawable
+{
+	/* Vertex positions in target space, interleaved x, y */
+	const float *vertex;
+	const csmVector2 *uv;
+	const unsigned short *index;
+	const int *mask;
+	const RenderTexture *texture;
+	/* Bounds in target space: minX, minY, maxX, maxY */
+	float bounds[4];
+	float opacity;
+	int indexCount, maskCount, blend, doubleSided;
+} RenderDrawable;
+
+typedef struct RenderContext
+{
+	unsigned char *output;
+	RenderDrawable *drawables;
+	/* Drawable index to draw, in render order */
+	const int *drawList;
+	int width, height, tilesX, tileCount, drawListCount, threadCount;
+	/* Non-zero if front faces have positive area in target space */
+	int positiveFront;
+} RenderContext;
+
+typedef struct RenderWorker
+{
+	const RenderContext *ctx;
+	/* RENDER_TILE_SIZE * RENDER_TILE_SIZE premultiplied RGBA */
+	float *color;
+	/* RENDER_TILE_SIZE * RENDER_TILE_SIZE mask coverage */
+	float *mask;
+	int id;
+} RenderWorker;
+
+typedef struct RenderPool RenderPool;
+
+typedef struct RenderPoolThread
+{
+	RenderPool *pool;
+	/* Job generation last seen by this thread */
+	unsigned int generation;
+	/* Runs worker index + 1, worker 0 is the calling thread */
+	int index;
+} RenderPoolThread;
+
+/* Worker threads, shared by all renders of the Lua state */
+struct RenderPool
+{
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE start, done;
+	HANDLE threads[RENDER_MAX_THREADS];
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	pthread_t threads[RENDER_MAX_THREADS];
+#endif
+	RenderPoolThread args[RENDER_MAX_THREADS];
+	/* Current job */
+	RenderWorker *workers;
+	/* Amount of pool threads which takes part in current job */
+	int jobCount;
+	/* Pool threads which not yet finished current job */
+	int pending;
+	/* Incremented when a job starts */
+	unsigned int generation;
+	int threadCount, quit;
+};
+
+static int l2dr_cpucount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int) count : 1;
+#else
+	return 1;
+#endif
+}
+
+/* Bilinear texture sampling with clamp-to-edge. Returns premultiplied RGBA in 0..1 */
+static vec4 l2dr_sample(const RenderTexture *tex, float u, float v)
+{
+	/* Texture V axis is bottom-up */
+	float fx = u * tex->width - 0.5f;
+	float fy = (1.0f - v) * tex->height - 0.5f;
+	float ax, ay;
+	int x0, y0, x1, y1;
+	vec4 t00, t10, t01, t11, top, bottom;
+
+	/* Also catches NaN */
+	if (!(fx > -1.0f)) fx = -1.0f;
+	if (!(fy > -1.0f)) fy = -1.0f;
+	if (fx > (float) tex->width) fx = (float) tex->width;
+	if (fy > (float) tex->height) fy = (float) tex->height;
+
+	x0 = (int) floorf(fx);
+	y0 = (int) floorf(fy);
+	ax = fx - (float) x0;
+	ay = fy - (float) y0;
+	x1 = x0 + 1;
+	y1 = y0 + 1;
+	x0 = x0 < 0 ? 0 : (x0 >= tex->width ? tex->width - 1 : x0);
+	x1 = x1 < 0 ? 0 : (x1 >= tex->width ? tex->width - 1 : x1);
+	y0 = y0 < 0 ? 0 : (y0 >= tex->height ? tex->height - 1 : y0);
+	y1 = y1 < 0 ? 0 : (y1 >= tex->height ? tex->height - 1 : y1);
+
+	t00 = vec4_loadrgba8(tex->data + ((size_t) y0 * tex->width + x0) * 4);
+	t10 = vec4_loadrgba8(tex->data + ((size_t) y0 * tex->width + x1) * 4);
+	t01 = vec4_loadrgba8(tex->data + ((size_t) y1 * tex->width + x0) * 4);
+	t11 = vec4_loadrgba8(tex->data + ((size_t) y1 * tex->width + x1) * 4);
+	top = vec4_add(t00, vec4_mul(vec4_sub(t10, t00), vec4_set1(ax)));
+	bottom = vec4_add(t01, vec4_mul(vec4_sub(t11, t01), vec4_set1(ax)));
+
+	return vec4_mul(vec4_add(top, vec4_mul(vec4_sub(bottom, top), vec4_set1(ay))), vec4_set1(1.0f / 255.0f));
+}
+
+/* Blend premultiplied source into destination pixel */
+static void l2dr_blend(float *dst, vec4 src, int blend)
+{
+	vec4 d = vec4_load(dst);
+	vec4 invSrcA = vec4_sub(vec4_set1(1.0f), vec4_alpha(src));
+
+	switch (blend)
+	{
+		case LUALIVE2D_BLEND_ADD:
+			/* RGB: src + dst, A: dst */
+			d = vec4_rgbalpha(vec4_add(d, src), d);
+			break;
+		case LUALIVE2D_BLEND_MULTIPLY:
+			/* RGB: src * dst + dst * (1 - srcA), A: dst */
+			d = vec4_rgbalpha(vec4_mul(d, vec4_add(src, invSrcA)), d);
+			break;
+		default:
+			/* src + dst * (1 - srcA) */
+			d = vec4_add(src, vec4_mul(d, invSrcA));
+			break;
+	}
+
+	vec4_store(dst, d);
+}
+
+/* Edge function. Positive if p is on the interior side of a -> b for positive area triangle. */
+static float l2dr_edge(const float *a, const float *b, float px, float py)
+{
+	return (b[0] - a[0]) * (py - a[1]) - (b[1] - a[1]) * (px - a[0]);
+}
+
+/* Top-left fill rule, for positive area triangle in y-down space */
+static int l2dr_istopleft(const float *a, const float *b)
+{
+	float dx = b[0] - a[0], dy = b[1] - a[1];
+	return dy < 0.0f || (dy == 0.0f && dx > 0.0f);
+}
+
+/* Compute pixel span [minX, maxX] of the row which may be inside the triangle. */
+/* Each edge function is linear along the row, so each edge bounds the span from */
+/* one side. The span is widened by 1 pixel, pixels are still tested exactly. */
+/* Returns 0 if the row is empty. */
+static int l2dr_span(const float *const *p, const float *dy, float cy, int minX, int maxX, int *spanMinX, int *spanMaxX)
+{
+	float cx = (float) minX + 0.5f;
+
+	*spanMinX = minX;
+	*spanMaxX = maxX;
+
+	for (int k = 0; k < 3; k++)
+	{
+		/* Edge value at the first pixel, decreasing by dy[k] per pixel */
+		float w = l2dr_edge(p[(k + 1) % 3], p[(k + 2) % 3], cx, cy);
+		float d;
+
+		if (dy[k] == 0.0f)
+		{
+			if (w < 0.0f)
+				return 0;
+
+			continue;
+		}
+
+		/* Pixel offset where the edge value crosses zero */
+		d = w / dy[k];
+
+		if (dy[k] > 0.0f)
+		{
+			/* Inside before the crossing */
+			if (d < (float) (*spanMaxX - minX))
+			{
+				if (d < -1.0f)
+					return 0;
+
+				*spanMaxX = minX + (int) floorf(d) + 1;
+			}
+		}
+		else if (d > (float) (*spanMinX - minX))
+		{
+			/* Inside after the crossing */
+			if (d > (float) (maxX - minX) + 1.0f)
+				return 0;
+
+			*spanMinX = minX + (int) ceilf(d) - 1;
+		}
+	}
+
+	if (*spanMinX < minX)
+		*spanMinX = minX;
+	if (*spanMaxX > maxX)
+		*spanMaxX = maxX;
+
+	return *spanMinX <= *spanMaxX;
+}
+
+/* Rasterize drawable into the tile. If maskOut is not NULL, the texture alpha is */
+/* accumulated into maskOut instead. Otherwise color is blended into worker color */
+/* buffer, multiplied by maskIn if it's not NULL. */
+static void l2dr_drawtile(const RenderWorker *worker, const RenderDrawable *draw, const float *maskIn, float *maskOut, int x0, int y0, int x1, int y1)
+{
+	for (int t = 0; t + 2 < draw->indexCount; t += 3)
+	{
+		const float *p[3];
+		const csmVector2 *uv[3];
+		float area, invArea, minX, minY, maxX, maxY, dy[3];
+		int tminX, tminY, tmaxX, tmaxY, topLeft[3];
+
+		for (int k = 0; k < 3; k++)
+		{
+			p[k] = draw->vertex + draw->index[t + k] * 2;
+			uv[k] = draw->uv + draw->index[t + k];
+		}
+
+		area = l2dr_edge(p[0], p[1], p[2][0], p[2][1]);
+		if (area == 0.0f || area != area)
+			continue;
+
+		/* Front face is counter-clockwise in model space. Masks are never culled. */
+		if (!draw->doubleSided && maskOut == NULL && ((area > 0.0f) != worker->ctx->positiveFront))
+			continue;
+
+		/* Make the area positive */
+		if (area < 0.0f)
+		{
+			const float *tp = p[1];
+			const csmVector2 *tuv = uv[1];
+			p[1] = p[2];
+			p[2] = tp;
+			uv[1] = uv[2];
+			uv[2] = tuv;
+			area = -area;
+		}
+
+		invArea = 1.0f / area;
+
+		/* Bounding box, clipped to tile */
+		minX = fminf(p[0][0], fminf(p[1][0], p[2][0]));
+		minY = fminf(p[0][1], fminf(p[1][1], p[2][1]));
+		maxX = fmaxf(p[0][0], fmaxf(p[1][0], p[2][0]));
+		maxY = fmaxf(p[0][1], fmaxf(p[1][1], p[2][1]));
+		if (maxX < (float) x0 || maxY < (float) y0 || minX >= (float) x1 || minY >= (float) y1)
+			continue;
+
+		tminX = minX > (float) x0 ? (int) minX : x0;
+		tminY = minY > (float) y0 ? (int) minY : y0;
+		tmaxX = maxX < (float) (x1 - 1) ? (int) maxX : x1 - 1;
+		tmaxY = maxY < (float) (y1 - 1) ? (int) maxY : y1 - 1;
+
+		/* Edge i is opposite to vertex i */
+		for (int k = 0; k < 3; k++)
+		{
+			const float *a = p[(k + 1) % 3], *b = p[(k + 2) % 3];
+			dy[k] = b[1] - a[1];
+			/* Pixels exactly on the edge only belongs to top-left edges */
+			topLeft[k] = l2dr_istopleft(a, b);
+		}
+
+		for (int y = tminY; y <= tmaxY; y++)
+		{
+			float cy = (float) y + 0.5f, cx;
+			float w0, w1, w2;
+			int row = (y - y0) * RENDER_TILE_SIZE - x0;
+			int spanMinX, spanMaxX;
+
+			if (!l2dr_span(p, dy, cy, tminX, tmaxX, &spanMinX, &spanMaxX))
+				continue;
+
+			cx = (float) spanMinX + 0.5f;
+			w0 = l2dr_edge(p[1], p[2], cx, cy);
+			w1 = l2dr_edge(p[2], p[0], cx, cy);
+			w2 = l2dr_edge(p[0], p[1], cx, cy);
+
+			for (int x = spanMinX; x <= spanMaxX; x++, w0 -= dy[0], w1 -= dy[1], w2 -= dy[2])
+			{
+				float l0, l1, l2, u, v;
+				vec4 texel;
+
+				if (
+					!(w0 > 0.0f || (w0 == 0.0f && topLeft[0])) ||
+					!(w1 > 0.0f || (w1 == 0.0f && topLeft[1])) ||
+					!(w2 > 0.0f || (w2 == 0.0f && topLeft[2]))
+				)
+					continue;
+
+				l0 = w0 * invArea;
+				l1 = w1 * invArea;
+				l2 = w2 * invArea;
+				u = l0 * uv[0]->X + l1 * uv[1]->X + l2 * uv[2]->X;
+				v = l0 * uv[0]->Y + l1 * uv[1]->Y + l2 * uv[2]->Y;
+				texel = l2dr_sample(draw->texture, u, v);
+
+				if (maskOut)
+				{
+					float *m = maskOut + row + x;
+					float a = vec4_geta(texel);
+					*m += a * (1.0f - *m);
+				}
+				else
+				{
+					float factor = draw->opacity;
+
+					if (maskIn)
+					{
+						factor *= maskIn[row + x];
+						if (factor <= 0.0f)
+							continue;
+					}
+
+					l2dr_blend(worker->color + (row + x) * 4, vec4_mul(texel, vec4_set1(factor)), draw->blend);
+				}
+			}
+		}
+	}
+}
+
+static void l2dr_rendertile(const RenderWorker *worker, int tile)
+{
+	const RenderContext *ctx = worker->ctx;
+	int x0 = (tile % ctx->tilesX) * RENDER_TILE_SIZE;
+	int y0 = (tile / ctx->tilesX) * RENDER_TILE_SIZE;
+	int x1 = x0 + RENDER_TILE_SIZE > ctx->width ? ctx->width : x0 + RENDER_TILE_SIZE;
+	int y1 = y0 + RENDER_TILE_SIZE > ctx->height ? ctx->height : y0 + RENDER_TILE_SIZE;
+
+	memset(worker->color, 0, sizeof(float) * 4 * RENDER_TILE_SIZE * RENDER_TILE_SIZE);
+
+	for (int i = 0; i < ctx->drawListCount; i++)
+	{
+		const RenderDrawable *draw = ctx->drawables + ctx->drawList[i];
+		const float *maskIn = NULL;
+
+		if (draw->bounds[2] < (float) x0 || draw->bounds[3] < (float) y0 || draw->bounds[0] >= (float) x1 || draw->bounds[1] >= (float) y1)
+			continue;
+
+		if (draw->maskCount > 0)
+		{
+			int anyMask = 0;
+
+			/* Build the clipping mask of this tile */
+			memset(worker->mask, 0, sizeof(float) * RENDER_TILE_SIZE * RENDER_TILE_SIZE);
+
+			for (int j = 0; j < draw->maskCount; j++)
+			{
+				const RenderDrawable *mask = ctx->drawables + draw->mask[j];
+
+				if (mask->vertex == NULL || mask->bounds[2] < (float) x0 || mask->bounds[3] < (float) y0 || mask->bounds[0] >= (float) x1 || mask->bounds[1] >= (float) y1)
+					continue;
+
+				l2dr_drawtile(worker, mask, NULL, worker->mask, x0, y0, x1, y1);
+				anyMask = 1;
+			}
+
+			/* Fully masked */
+			if (!anyMask)
+				continue;
+
+			maskIn = worker->mask;
+		}
+
+		l2dr_drawtile(worker, draw, maskIn, NULL, x0, y0, x1, y1);
+	}
+
+	/* Write to output */
+	for (int y = y0; y < y1; y++)
+	{
+		const float *src = worker->color + (y - y0) * RENDER_TILE_SIZE * 4;
+		unsigned char *dst = ctx->output + ((size_t) y * ctx->width + x0) * 4;
+
+		for (int x = x0; x < x1; x++, src += 4, dst += 4)
+			vec4_storergba8(dst, vec4_load(src));
+	}
+}
+
+static void l2dr_workermain(RenderWorker *worker)
+{
+	/* Tiles are interleaved between workers */
+	for (int tile = worker->id; tile < worker->ctx->tileCount; tile += worker->ctx->threadCount)
+		l2dr_rendertile(worker, tile);
+}
+
+#ifdef _WIN32
+#define l2dr_poollock(pool) EnterCriticalSection(&(pool)->lock)
+#define l2dr_poolunlock(pool) LeaveCriticalSection(&(pool)->lock)
+#define l2dr_poolwait(pool, cond) SleepConditionVariableCS(&(pool)->cond, &(pool)->lock, INFINITE)
+#define l2dr_poolsignal(pool, cond) WakeAllConditionVariable(&(pool)->cond)
+#else
+#define l2dr_poollock(pool) pthread_mutex_lock(&(pool)->lock)
+#define l2dr_poolunlock(pool) pthread_mutex_unlock(&(pool)->lock)
+#define l2dr_poolwait(pool, cond) pthread_cond_wait(&(pool)->cond, &(pool)->lock)
+#define l2dr_poolsignal(pool, cond) pthread_cond_broadcast(&(pool)->cond)
+#endif
+
+static void l2dr_poolmain(RenderPoolThread *thread)
+{
+	RenderPool *pool = thread->pool;
+
+	l2dr_poollock(pool);
+
+	for (;;)
+	{
+		while (!pool->quit && pool->generation == thread->generation)
+			l2dr_poolwait(pool, start);
+
+		if (pool->quit)
+			break;
+
+		thread->generation = pool->generation;
+
+		/* Job may need less threads than the pool has */
+		if (thread->index < pool->jobCount)
+		{
+			RenderWorker *worker = pool->workers + thread->index + 1;
+
+			l2dr_poolunlock(pool);
+			l2dr_workermain(worker);
+			l2dr_poollock(pool);
+
+			if (--pool->pending == 0)
+				l2dr_poolsignal(pool, done);
+		}
+	}
+
+	l2dr_poolunlock(pool);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI l2dr_threadmain(LPVOID thread)
+{
+	l2dr_poolmain((RenderPoolThread *) thread);
+	return 0;
+}
+#else
+static void *l2dr_threadmain(void *thread)
+{
+	l2dr_poolmain((RenderPoolThread *) thread);
+	return NULL;
+}
+#endif
+
+/* Start pool threads until there are count of them. Returns amount of threads */
+/* which could be started. Must not be called while a job is running. */
+static int l2dr_poolgrow(RenderPool *pool, int count)
+{
+	while (pool->threadCount < count)
+	{
+		RenderPoolThread *thread = pool->args + pool->threadCount;
+
+		thread->pool = pool;
+		thread->generation = pool->generation;
+		thread->index = pool->threadCount;
+
+#ifdef _WIN32
+		pool->threads[pool->threadCount] = CreateThread(NULL, 0, l2dr_threadmain, thread, 0, NULL);
+		if (pool->threads[pool->threadCount] == NULL)
+			break;
+#else
+		if (pthread_create(&pool->threads[pool->threadCount], NULL, l2dr_threadmain, thread) != 0)
+			break;
+#endif
+
+		pool->threadCount++;
+	}
+
+	return pool->threadCount < count ? pool->threadCount : count;
+}
+
+static void l2dr_run(RenderPool *pool, RenderWorker *workers, int threadCount)
+{
+	/* Worker 0 runs in the calling thread */
+	int jobCount = l2dr_poolgrow(pool, threadCount - 1);
+
+	if (jobCount > 0)
+	{
+		l2dr_poollock(pool);
+		pool->workers = workers;
+		pool->jobCount = pool->pending = jobCount;
+		pool->generation++;
+		l2dr_poolsignal(pool, start);
+		l2dr_poolunlock(pool);
+	}
+
+	l2dr_workermain(workers);
+
+	/* Cannot start thread, do its work here */
+	for (int i = jobCount + 1; i < threadCount; i++)
+		l2dr_workermain(workers + i);
+
+	if (jobCount > 0)
+	{
+		l2dr_poollock(pool);
+		while (pool->pending > 0)
+			l2dr_poolwait(pool, done);
+		l2dr_poolunlock(pool);
+	}
+}
+
+static int l2drp___gc(lua_State *L)
+{
+	RenderPool *pool = (RenderPool *) luaL_checkudata(L, 1, RENDERPOOL_METATABLE_NAME);
+
+	l2dr_poollock(pool);
+	pool->quit = 1;
+	l2dr_poolsignal(pool, start);
+	l2dr_poolunlock(pool);
+
+	for (int i = 0; i < pool->threadCount; i++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#else
+		pthread_join(pool->threads[i], NULL);
+#endif
+	}
+
+	pool->threadCount = 0;
+#ifdef _WIN32
+	DeleteCriticalSection(&pool->lock);
+#else
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+#endif
+	return 0;
+}
+
+/* Read textures which referenced by the model. Texture is table with "width", */
+/* "height" and "data" (premultiplied RGBA8 string) fields. */
+static RenderTexture *l2dr_checktextures(lua_State *L, int idx, ModelDefinition *model)
+{
+	int drawCount = csmGetDrawableCount(model->model);
+	const int *drawTex = csmGetDrawableTextureIndices(model->model);
+	int texCount = 0;
+	RenderTexture *textures;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		if (drawTex[i] + 1 > texCount)
+			texCount = drawTex[i] + 1;
+	}
+
+	textures = (RenderTexture *) lua_newuserdata(L, sizeof(RenderTexture) * (texCount + 1));
+	memset(textures, 0, sizeof(RenderTexture) * (texCount + 1));
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		RenderTexture *tex;
+		size_t dataSize;
+
+		if (drawTex[i] < 0)
+			continue;
+
+		tex = textures + drawTex[i];
+		if (tex->data != NULL)
+			continue;
+
+		lua_rawgeti(L, idx, drawTex[i] + 1);
+		if (!lua_istable(L, -1))
+			luaL_error(L, "missing texture #%d", drawTex[i] + 1);
+
+		lua_getfield(L, -1, "width");
+		tex->width = (int) lua_tointeger(L, -1);
+		lua_getfield(L, -2, "height");
+		tex->height = (int) lua_tointeger(L, -1);
+		lua_getfield(L, -3, "data");
+		tex->data = (const unsigned char *) lua_tolstring(L, -1, &dataSize);
+
+		if (tex->width <= 0 || tex->height <= 0 || tex->data == NULL || dataSize < (size_t) tex->width * tex->height * 4)
+			luaL_error(L, "invalid texture #%d", drawTex[i] + 1);
+
+		/* Texture data string is still referenced by the textures table */
+		lua_pop(L, 4);
+	}
+
+	return textures;
+}
+
+int l2dw_renderToBuffer(lua_State *L)
+{
+	ModelDefinition *model;
+	RenderContext ctx;
+	RenderWorker workers[RENDER_MAX_THREADS];
+	RenderTexture *textures;
+	PixelBuffer *output;
+	float transform[6], det, *vertexBuffer, *tileBuffer;
+	int drawCount, totalVertex, threadCount, *drawList;
+	const int *drawVertexCount, *drawIndexCount, *drawRenderOrder, *drawTex, *drawMaskCount, **drawMask;
+	const unsigned short **drawIndex;
+	const csmFlags *drawConstFlags, *drawDynFlags;
+	const float *drawOpacity;
+	const csmVector2 **drawVertex, **drawUVs;
+	PROFILE_BEGIN(profile);
+
+	model = (ModelDefinition *) luaL_checkudata(L, 1, LUALIVE2D_METATABLE_NAME);
+	/* Temporary memory is pushed to the stack, keep arguments at fixed index */
+	lua_settop(L, 7);
+	ctx.width = luaL_checkint(L, 2);
+	ctx.height = luaL_checkint(L, 3);
+	luaL_argcheck(L, ctx.width > 0 && ctx.width <= RENDER_MAX_SIZE, 2, "invalid width");
+	luaL_argcheck(L, ctx.height > 0 && ctx.height <= RENDER_MAX_SIZE, 3, "invalid height");
+
+	/* Previous output can be reused */
+	if (lua_isnoneornil(L, 7))
+		output = NULL;
+	else
+	{
+		output = (PixelBuffer *) luaL_checkudata(L, 7, PIXELBUFFER_METATABLE_NAME);
+		luaL_argcheck(L, output->width == ctx.width && output->height == ctx.height, 7, "buffer size mismatch");
+	}
+
+	textures = l2dr_checktextures(L, 4, model);
+
+	if (lua_isnoneornil(L, 5))
+	{
+		/* Fit model canvas to the render target. Model Y axis is up. */
+		float sx = ctx.width / model->modelDimensions.X, sy = ctx.height / model->modelDimensions.Y;
+		transform[0] = model->modelDPI * sx;
+		transform[1] = transform[2] = 0.0f;
+		transform[3] = -model->modelDPI * sy;
+		transform[4] = model->modelCenter.X * sx;
+		transform[5] = model->modelCenter.Y * sy;
+	}
+	else
+		l2dh_opttransform(L, 5, transform);
+
+	threadCount = luaL_optint(L, 6, 0);
+	if (threadCount <= 0)
+		threadCount = l2dr_cpucount();
+
+	drawCount = csmGetDrawableCount(model->model);
+	drawVertexCount = csmGetDrawableVertexCounts(model->model);
+	drawIndexCount = csmGetDrawableIndexCounts(model->model);
+	drawRenderOrder = csmGetDrawableRenderOrders(model->model);
+	drawTex = csmGetDrawableTextureIndices(model->model);
+	drawMaskCount = csmGetDrawableMaskCounts(model->model);
+	drawMask = csmGetDrawableMasks(model->model);
+	drawIndex = csmGetDrawableIndices(model->model);
+	drawConstFlags = csmGetDrawableConstantFlags(model->model);
+	drawDynFlags = csmGetDrawableDynamicFlags(model->model);
+	drawOpacity = csmGetDrawableOpacities(model->model);
+	drawVertex = l2dh_vertexpositions(model);
+	drawUVs = csmGetDrawableVertexUvs(model->model);
+
+	/* All temporary memory are userdata so nothing leaks on error */
+	totalVertex = 0;
+	for (int i = 0; i < drawCount; i++)
+		totalVertex += drawVertexCount[i];
+
+	ctx.drawables = (RenderDrawable *) lua_newuserdata(L, sizeof(RenderDrawable) * (drawCount + 1));
+	drawList = (int *) lua_newuserdata(L, sizeof(int) * (drawCount + 1));
+	vertexBuffer = (float *) lua_newuserdata(L, sizeof(float) * 2 * (totalVertex + 1));
+
+	/* Transform all vertices, including invisible drawables as it may be used as mask */
+	for (int i = 0, vertexOffset = 0; i < drawCount; i++)
+	{
+		RenderDrawable *draw = ctx.drawables + i;
+		float *out = vertexBuffer + vertexOffset * 2;
+
+		drawList[i] = -1;
+		draw->bounds[0] = draw->bounds[1] = FLT_MAX;
+		draw->bounds[2] = draw->bounds[3] = -FLT_MAX;
+
+		for (int j = 0; j < drawVertexCount[i]; j++)
+		{
+			float x = drawVertex[i][j].X, y = drawVertex[i][j].Y;
+			float tx = transform[0] * x + transform[2] * y + transform[4];
+			float ty = transform[1] * x + transform[3] * y + transform[5];
+
+			out[j * 2] = tx;
+			out[j * 2 + 1] = ty;
+			if (tx < draw->bounds[0]) draw->bounds[0] = tx;
+			if (ty < draw->bounds[1]) draw->bounds[1] = ty;
+			if (tx > draw->bounds[2]) draw->bounds[2] = tx;
+			if (ty > draw->bounds[3]) draw->bounds[3] = ty;
+		}
+
+		draw->vertex = drawVertexCount[i] > 0 && drawTex[i] >= 0 ? out : NULL;
+		draw->uv = drawUVs[i];
+		draw->index = drawIndex[i];
+		draw->indexCount = drawIndexCount[i];
+		draw->mask = drawMask[i];
+		draw->maskCount = drawMaskCount[i];
+		draw->texture = drawTex[i] >= 0 ? textures + drawTex[i] : NULL;
+		draw->opacity = drawOpacity[i];
+		draw->blend = l2dh_blendmode(drawConstFlags[i]);
+		draw->doubleSided = (drawConstFlags[i] & csmIsDoubleSided) != 0;
+		vertexOffset += drawVertexCount[i];
+
+		/* Render order is a permutation of drawable indices */
+		if (
+			draw->vertex && (drawDynFlags[i] & csmIsVisible) && drawOpacity[i] > 0.0f &&
+			drawRenderOrder[i] >= 0 && drawRenderOrder[i] < drawCount
+		)
+			drawList[drawRenderOrder[i]] = i;
+	}
+
+	/* Compact draw list */
+	ctx.drawListCount = 0;
+	for (int i = 0; i < drawCount; i++)
+	{
+		if (drawList[i] >= 0)
+			drawList[ctx.drawListCount++] = drawList[i];
+	}
+
+	/* Winding in target space depends on the transform orientation */
+	det = transform[0] * transform[3] - transform[1] * transform[2];
+	ctx.positiveFront = det > 0.0f;
+	ctx.drawList = drawList;
+	ctx.tilesX = (ctx.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	ctx.tileCount = ctx.tilesX * ((ctx.height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE);
+
+	if (threadCount > RENDER_MAX_THREADS)
+		threadCount = RENDER_MAX_THREADS;
+	if (threadCount > ctx.tileCount)
+		threadCount = ctx.tileCount;
+	ctx.threadCount = threadCount;
+
+	/* Per-worker tile buffers */
+	tileBuffer = (float *) lua_newuserdata(L, sizeof(float) * 5 * RENDER_TILE_SIZE * RENDER_TILE_SIZE * threadCount);
+	for (int i = 0; i < threadCount; i++)
+	{
+		workers[i].ctx = &ctx;
+		workers[i].id = i;
+		workers[i].color = tileBuffer + i * 5 * RENDER_TILE_SIZE * RENDER_TILE_SIZE;
+		workers[i].mask = workers[i].color + 4 * RENDER_TILE_SIZE * RENDER_TILE_SIZE;
+	}
+
+	if (output == NULL)
+	{
+		output = (PixelBuffer *) lua_newuserdata(L, sizeof(PixelBuffer) + (size_t) ctx.width * ctx.height * 4);
+		output->width = ctx.width;
+		output->height = ctx.height;
+		luaL_getmetatable(L, PIXELBUFFER_METATABLE_NAME);
+		lua_setmetatable(L, -2);
+	}
+	else
+		lua_pushvalue(L, 7);
+
+	ctx.output = output->data;
+	lua_getfield(L, LUA_REGISTRYINDEX, RENDERPOOL_NAME);
+	l2dr_run((RenderPool *) lua_touserdata(L, -1), workers, threadCount);
+	lua_pop(L, 1);
+
+	PROFILE_ADD(profile, vertices, totalVertex);
+	PROFILE_ADD(profile, bytes, (size_t) ctx.width * ctx.height * 4);
+	PROFILE_END(profile, model, LUALIVE2D_PROFILE_RENDERTOBUFFER);
+	return 1;
+}
+
+/* Copy the pixels to a string */
+static int l2dpb_getString(lua_State *L)
+{
+	PixelBuffer *buffer = (PixelBuffer *) luaL_checkudata(L, 1, PIXELBUFFER_METATABLE_NAME);
+	lua_pushlstring(L, (const char *) buffer->data, (size_t) buffer->width * buffer->height * 4);
+	return 1;
+}
+
+static int l2dpb_getDimensions(lua_State *L)
+{
+	PixelBuffer *buffer = (PixelBuffer *) luaL_checkudata(L, 1, PIXELBUFFER_METATABLE_NAME);
+	lua_pushinteger(L, buffer->width);
+	lua_pushinteger(L, buffer->height);
+	return 2;
+}
+
+/* Pixel data pointer, for LuaJIT FFI. Valid as long as the buffer is alive. */
+static int l2dpb_getPointer(lua_State *L)
+{
+	PixelBuffer *buffer = (PixelBuffer *) luaL_checkudata(L, 1, PIXELBUFFER_METATABLE_NAME);
+	lua_pushlightuserdata(L, buffer->data);
+	return 1;
+}
+
+/* Pixel buffer methods to export */
+static const luaL_Reg l2dpb_export[] = {
+	{"getString", &l2dpb_getString},
+	{"getDimensions", &l2dpb_getDimensions},
+	{"getPointer", &l2dpb_getPointer},
+	{NULL, NULL}
+};
+
+/* Pool methods */
+static const luaL_Reg l2drp_export[] = {
+	{"__gc", &l2drp___gc},
+	{NULL, NULL}
+};
+
+void l2d_openrender(lua_State *L)
+{
+	l2dh_newmetatable(L, PIXELBUFFER_METATABLE_NAME, l2dpb_export);
+
+	/* Worker pool, threads are started on first multithreaded render and */
+	/* joined when the Lua state is closed */
+	lua_getfield(L, LUA_REGISTRYINDEX, RENDERPOOL_NAME);
+	if (lua_isnil(L, -1))
+	{
+		RenderPool *pool;
+
+		lua_pop(L, 1);
+		l2dh_newmetatable(L, RENDERPOOL_METATABLE_NAME, l2drp_export);
+		pool = (RenderPool *) lua_newuserdata(L, sizeof(RenderPool));
+		memset(pool, 0, sizeof(RenderPool));
+#ifdef _WIN32
+		InitializeCriticalSection(&pool->lock);
+		InitializeConditionVariable(&pool->start);
+		InitializeConditionVariable(&pool->done);
+#else
+		pthread_mutex_init(&pool->lock, NULL);
+		pthread_cond_init(&pool->start, NULL);
+		pthread_cond_init(&pool->done, NULL);
+#endif
+		luaL_getmetatable(L, RENDERPOOL_METATABLE_NAME);
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, RENDERPOOL_NAME);
+	}
+	else
+		lua_pop(L, 1);
+}
@@ -0,0 +1,545 @@
+/**
+ * Copyright (C) 2019 Miku AuahDark
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/* Level-of-detail update scheduler. */
+/* Each model is updated every "interval" steps, derived from its importance. */
+/* Updates are spread across steps with a vertex budget, so per-step cost stays */
+/* flat, and steps between real updates interpolate vertex positions between */
+/* the last two updates. Interpolation runs lazily when positions are read. */
+
+/* std */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lua */
+#include "lua.h"
+#include "lauxlib.h"
+
+/* lua-live2d */
+#include "lualive2d.h"
+
+#define SCHEDULER_METATABLE_NAME "Live2DScheduler*"
+
+typedef struct Scheduler
+{
+	ModelDefinition **models;
+	/* Scratch list of models due for update */
+	ModelDefinition **due;
+	int count, capacity;
+	/* Vertices to update per step, 0 means average of all models */
+	int budget;
+	int maxInterval;
+	/* Unspent budget, negative when previous steps went over */
+	double credit;
+} Scheduler;
+
+static void l2dh_lerpvertex(const float *a, const float *b, float *out, int floatCount, float t)
+{
+	int i = 0;
+
+#if defined(LUALIVE2D_SSE)
+	__m128 vt = _mm_set1_ps(t);
+
+	for (; i + 4 <= floatCount; i += 4)
+	{
+		__m128 va = _mm_loadu_ps(a + i);
+		__m128 vb = _mm_loadu_ps(b + i);
+		_mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vt)));
+	}
+#elif defined(LUALIVE2D_NEON)
+	float32x4_t vt = vdupq_n_f32(t);
+
+	for (; i + 4 <= floatCount; i += 4)
+	{
+		float32x4_t va = vld1q_f32(a + i);
+		float32x4_t vb = vld1q_f32(b + i);
+		vst1q_f32(out + i, vmlaq_f32(va, vsubq_f32(vb, va), vt));
+	}
+#endif
+
+	/* Remaining values */
+	for (; i < floatCount; i++)
+		out[i] = a[i] + (b[i] - a[i]) * t;
+}
+
+const csmVector2 **l2dh_vertexpositions(ModelDefinition *model)
+{
+	ModelLOD *lod = model->lod;
+
+	if (lod == NULL)
+		return csmGetDrawableVertexPositions(model->model);
+
+	if (lod->dirty)
+	{
+		int drawCount = csmGetDrawableCount(model->model);
+		const int *drawVertexCount = csmGetDrawableVertexCounts(model->model);
+
+		for (int i = 0; i < drawCount; i++)
+		{
+			int offset = lod->vertexOffset[i];
+
+			if (lod->alpha >= 1.0f || !lod->moving[i])
+				lod->positions[i] = lod->last + offset;
+			else
+			{
+				l2dh_lerpvertex(
+					(const float *) (lod->prev + offset),
+					(const float *) (lod->last + offset),
+					(float *) (lod->out + offset),
+					drawVertexCount[i] * 2,
+					lod->alpha
+				);
+				lod->positions[i] = lod->out + offset;
+			}
+		}
+
+		lod->dirty = 0;
+	}
+
+	return lod->positions;
+}
+
+/* Called after csmUpdateModel and bounds update of scheduled model */
+void l2dh_lodcapture(ModelDefinition *model)
+{
+	ModelLOD *lod = model->lod;
+	int drawCount = csmGetDrawableCount(model->model);
+	const int *drawVertexCount = csmGetDrawableVertexCounts(model->model);
+	const csmVector2 **drawVertex = csmGetDrawableVertexPositions(model->model);
+	csmVector2 *tempVertex;
+	float *tempBounds;
+
+	tempVertex = lod->prev;
+	lod->prev = lod->last;
+	lod->last = tempVertex;
+	tempBounds = lod->prevBounds;
+	lod->prevBounds = lod->lastBounds;
+	lod->lastBounds = tempBounds;
+	memcpy(lod->lastBounds, model->drawableBounds, sizeof(float) * 4 * drawCount);
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		int offset = lod->vertexOffset[i];
+		size_t size = sizeof(csmVector2) * drawVertexCount[i];
+
+		memcpy(lod->last + offset, drawVertex[i], size);
+		/* Moving drawable may not reached its last position when updated early */
+		lod->changed[i] |= lod->moving[i];
+		lod->moving[i] = memcmp(lod->prev + offset, lod->last + offset, size) != 0;
+		lod->changed[i] |= lod->moving[i];
+
+		if (lod->reset && lod->moving[i])
+		{
+			memcpy(lod->prev + offset, lod->last + offset, size);
+			lod->moving[i] = 0;
+		}
+	}
+
+	if (lod->reset)
+		memcpy(lod->prevBounds, lod->lastBounds, sizeof(float) * 4 * drawCount);
+
+	lod->phase = 0;
+	lod->dirty = 1;
+	lod->reset = 0;
+}
+
+void l2dh_lodsetalpha(ModelDefinition *model, float alpha)
+{
+	ModelLOD *lod = model->lod;
+	int drawCount = csmGetDrawableCount(model->model);
+	int alphaChanged = alpha != lod->alpha;
+
+	lod->alpha = alpha;
+	lod->dirty = 1;
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		float *bounds = model->drawableBounds + i * 4;
+		const float *last = lod->lastBounds + i * 4;
+		float newBounds[4];
+
+		if (alpha >= 1.0f || !lod->moving[i])
+			memcpy(newBounds, last, sizeof(float) * 4);
+		else
+		{
+			/* Interpolated vertices lies within both bounds */
+			const float *prev = lod->prevBounds + i * 4;
+
+			newBounds[0] = prev[0] < last[0] ? prev[0] : last[0];
+			newBounds[1] = prev[1] < last[1] ? prev[1] : last[1];
+			newBounds[2] = prev[2] > last[2] ? prev[2] : last[2];
+			newBounds[3] = prev[3] > last[3] ? prev[3] : last[3];
+		}
+
+		if (alphaChanged)
+			lod->changed[i] |= lod->moving[i];
+
+		if (memcmp(bounds, newBounds, sizeof(float) * 4) != 0)
+		{
+			memcpy(bounds, newBounds, sizeof(float) * 4);
+			l2dh_markbounds(model, i);
+		}
+	}
+
+	l2dh_updatemodelbounds(model);
+}
+
+/* Parameters were set to an unrelated state (e.g. restored from snapshot). Don't */
+/* interpolate from the old pose and make it due at the next step. */
+void l2dh_lodreset(ModelDefinition *model)
+{
+	ModelLOD *lod = model->lod;
+
+	lod->reset = 1;
+	if (lod->phase < lod->interval - 1)
+		lod->phase = lod->interval - 1;
+}
+
+static void l2dh_lodfree(ModelLOD *lod)
+{
+	free(lod->prev);
+	free(lod->last);
+	free(lod->out);
+	free(lod->positions);
+	free(lod->prevBounds);
+	free(lod->lastBounds);
+	free(lod->vertexOffset);
+	free(lod->moving);
+	free(lod->changed);
+	free(lod);
+}
+
+void l2dh_freelod(ModelDefinition *model)
+{
+	if (model->lod)
+	{
+		/* Leave the model at its last update */
+		l2dh_lodsetalpha(model, 1.0f);
+		l2dh_lodfree(model->lod);
+		model->lod = NULL;
+	}
+}
+
+static int l2dh_interval(Scheduler *sched, lua_Number importance)
+{
+	lua_Number interval = floor(1.0 / importance + 0.5);
+
+	if (interval < 1.0)
+		return 1;
+	else if (interval > (lua_Number) sched->maxInterval)
+		return sched->maxInterval;
+
+	return (int) interval;
+}
+
+static int l2dh_findmodel(Scheduler *sched, ModelDefinition *model)
+{
+	for (int i = 0; i < sched->count; i++)
+	{
+		if (sched->models[i] == model)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Most overdue model first */
+static int l2dh_urgencycompare(const void *a, const void *b)
+{
+	const ModelLOD *lodA = (*(ModelDefinition *const *) a)->lod;
+	const ModelLOD *lodB = (*(ModelDefinition *const *) b)->lod;
+	long long urgencyA = (long long) lodA->phase * lodB->interval;
+	long long urgencyB = (long long) lodB->phase * lodA->interval;
+
+	return (urgencyA < urgencyB) - (urgencyA > urgencyB);
+}
+
+int l2d_newScheduler(lua_State *L)
+{
+	Scheduler *sched;
+	int budget = luaL_optint(L, 1, 0);
+	int maxInterval = luaL_optint(L, 2, 8);
+
+	luaL_argcheck(L, budget >= 0, 1, "budget must not be negative");
+	luaL_argcheck(L, maxInterval > 0, 2, "invalid maximum interval");
+
+	sched = (Scheduler *) lua_newuserdata(L, sizeof(Scheduler));
+	memset(sched, 0, sizeof(Scheduler));
+	sched->budget = budget;
+	sched->maxInterval = maxInterval;
+	luaL_getmetatable(L, SCHEDULER_METATABLE_NAME);
+	lua_setmetatable(L, -2);
+
+	/* Keep the models alive, keyed by model */
+	lua_newtable(L);
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+static int l2dl___gc(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+
+	/* Models which outlive the scheduler are updated normally again */
+	for (int i = 0; i < sched->count; i++)
+		l2dh_freelod(sched->models[i]);
+
+	free(sched->models);
+	free(sched->due);
+	sched->models = sched->due = NULL;
+	sched->count = sched->capacity = 0;
+	return 0;
+}
+
+static int l2dl_add(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 2, LUALIVE2D_METATABLE_NAME);
+	lua_Number importance = luaL_optnumber(L, 3, 1.0);
+	int drawCount, totalVertex = 0;
+	const int *drawVertexCount;
+	ModelLOD *lod;
+
+	luaL_argcheck(L, importance > 0.0, 3, "importance must be positive");
+	if (model->lod)
+		luaL_argerror(L, 2, "model is already scheduled");
+
+	if (sched->count == sched->capacity)
+	{
+		int newCapacity = sched->capacity ? sched->capacity * 2 : 16;
+		ModelDefinition **newModels, **newDue;
+
+		newModels = (ModelDefinition **) realloc(sched->models, sizeof(ModelDefinition *) * newCapacity);
+		if (newModels == NULL)
+			luaL_error(L, "cannot allocate scheduler");
+		sched->models = newModels;
+
+		newDue = (ModelDefinition **) realloc(sched->due, sizeof(ModelDefinition *) * newCapacity);
+		if (newDue == NULL)
+			luaL_error(L, "cannot allocate scheduler");
+		sched->due = newDue;
+
+		sched->capacity = newCapacity;
+	}
+
+	drawCount = csmGetDrawableCount(model->model);
+	drawVertexCount = csmGetDrawableVertexCounts(model->model);
+
+	lod = (ModelLOD *) calloc(1, sizeof(ModelLOD));
+	if (lod == NULL)
+		luaL_error(L, "cannot allocate model LOD");
+
+	/* +1 to prevent zero-size allocation */
+	lod->vertexOffset = (int *) malloc(sizeof(int) * (drawCount + 1));
+	if (lod->vertexOffset == NULL)
+	{
+		l2dh_lodfree(lod);
+		luaL_error(L, "cannot allocate model LOD");
+	}
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		lod->vertexOffset[i] = totalVertex;
+		totalVertex += drawVertexCount[i];
+	}
+
+	lod->prev = (csmVector2 *) calloc(totalVertex + 1, sizeof(csmVector2));
+	lod->last = (csmVector2 *) calloc(totalVertex + 1, sizeof(csmVector2));
+	lod->out = (csmVector2 *) calloc(totalVertex + 1, sizeof(csmVector2));
+	lod->positions = (const csmVector2 **) calloc(drawCount + 1, sizeof(csmVector2 *));
+	lod->prevBounds = (float *) malloc(sizeof(float) * 4 * (drawCount + 1));
+	lod->lastBounds = (float *) malloc(sizeof(float) * 4 * (drawCount + 1));
+	lod->moving = (unsigned char *) calloc(drawCount + 1, 1);
+	lod->changed = (unsigned char *) calloc(drawCount + 1, 1);
+	if (
+		lod->prev == NULL || lod->last == NULL || lod->out == NULL || lod->positions == NULL ||
+		lod->prevBounds == NULL || lod->lastBounds == NULL || lod->moving == NULL || lod->changed == NULL
+	)
+	{
+		l2dh_lodfree(lod);
+		luaL_error(L, "cannot allocate model LOD");
+	}
+
+	lod->alpha = 1.0f;
+	lod->dirty = 1;
+	lod->interval = l2dh_interval(sched, importance);
+	lod->cost = totalVertex > 0 ? totalVertex : 1;
+	model->lod = lod;
+
+	/* Start from fresh update, with nothing to interpolate */
+	memcpy(lod->lastBounds, model->drawableBounds, sizeof(float) * 4 * drawCount);
+	l2dh_updatemodel(model);
+	memcpy(lod->prev, lod->last, sizeof(csmVector2) * totalVertex);
+	memcpy(lod->prevBounds, lod->lastBounds, sizeof(float) * 4 * drawCount);
+	memset(lod->moving, 0, drawCount);
+	memset(lod->changed, 0, drawCount);
+	l2dh_lodsetalpha(model, 1.0f);
+
+	/* Stagger models with same interval so their updates don't land on same step */
+	lod->phase = sched->count % lod->interval;
+	sched->models[sched->count++] = model;
+
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	return 0;
+}
+
+static int l2dl_remove(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 2, LUALIVE2D_METATABLE_NAME);
+	int index = l2dh_findmodel(sched, model);
+
+	if (index == -1)
+	{
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	l2dh_freelod(model);
+	sched->models[index] = sched->models[--sched->count];
+
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int l2dl_setImportance(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+	ModelDefinition *model = (ModelDefinition *) luaL_checkudata(L, 2, LUALIVE2D_METATABLE_NAME);
+	lua_Number importance = luaL_checknumber(L, 3);
+
+	luaL_argcheck(L, importance > 0.0, 3, "importance must be positive");
+	if (l2dh_findmodel(sched, model) == -1)
+		luaL_argerror(L, 2, "model is not in this scheduler");
+
+	/* Phase is kept, model which is now overdue updates on next step */
+	model->lod->interval = l2dh_interval(sched, importance);
+	lua_pushinteger(L, model->lod->interval);
+	return 1;
+}
+
+static int l2dl_setBudget(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+	int budget = luaL_checkint(L, 2);
+
+	luaL_argcheck(L, budget >= 0, 2, "budget must not be negative");
+	sched->budget = budget;
+	sched->credit = 0.0;
+	return 0;
+}
+
+static int l2dl_step(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+	int dueCount = 0, updateCount = 0, updateCost = 0;
+	double budget = (double) sched->budget;
+	PROFILE_BEGIN(profile);
+
+	for (int i = 0; i < sched->count; i++)
+	{
+		ModelLOD *lod = sched->models[i]->lod;
+
+		lod->phase++;
+		if (lod->phase >= lod->interval)
+			sched->due[dueCount++] = sched->models[i];
+
+		/* Automatic budget is the average update cost per step */
+		if (sched->budget == 0)
+			budget += (double) lod->cost / lod->interval;
+	}
+
+	/* Unspent budget is not saved for later, but overspent one is paid back */
+	sched->credit += ceil(budget);
+	if (sched->credit > ceil(budget))
+		sched->credit = ceil(budget);
+
+	qsort(sched->due, dueCount, sizeof(ModelDefinition *), l2dh_urgencycompare);
+
+	/* Due models which don't fit the budget wait for next step */
+	for (int i = 0; i < dueCount && sched->credit > 0.0; i++)
+	{
+		ModelDefinition *model = sched->due[i];
+
+		l2dh_updatemodel(model);
+		sched->credit -= model->lod->cost;
+		updateCount++;
+		updateCost += model->lod->cost;
+	}
+
+	for (int i = 0; i < sched->count; i++)
+	{
+		ModelLOD *lod = sched->models[i]->lod;
+		float alpha = (float) (lod->phase + 1) / (float) lod->interval;
+
+		if (alpha > 1.0f)
+			alpha = 1.0f;
+		/* Don't go back after model:update() until next real update */
+		if (lod->phase > 0 && alpha < lod->alpha)
+			alpha = lod->alpha;
+
+		/* Updated models always need their bounds refreshed */
+		if (alpha != lod->alpha || lod->phase == 0)
+			l2dh_lodsetalpha(sched->models[i], alpha);
+	}
+
+	PROFILE_ADD(profile, vertices, updateCost);
+	PROFILE_END(profile, NULL, LUALIVE2D_PROFILE_SCHEDULERSTEP);
+
+	lua_pushinteger(L, updateCount);
+	lua_pushinteger(L, updateCost);
+	return 2;
+}
+
+static int l2dl_getCount(lua_State *L)
+{
+	Scheduler *sched = (Scheduler *) luaL_checkudata(L, 1, SCHEDULER_METATABLE_NAME);
+	lua_pushinteger(L, sched->count);
+	return 1;
+}
+
+/* Scheduler methods to export */
+static const luaL_Reg l2dl_export[] = {
+	{"__gc", &l2dl___gc},
+	{"add", &l2dl_add},
+	{"remove", &l2dl_remove},
+	{"setImportance", &l2dl_setImportance},
+	{"setBudget", &l2dl_setBudget},
+	{"step", &l2dl_step},
+	{"getCount", &l2dl_getCount},
+	{NULL, NULL}
+};
+
+void l2d_openscheduler(lua_State *L)
+{
+	l2dh_newmetatable(L, SCHEDULER_METATABLE_NAME, l2dl_export);
+}